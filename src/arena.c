@@ -0,0 +1,51 @@
+#include "arena.h"
+#include "vmalloc.h"
+#include "process.h"
+
+// Scratch arenas hand out temporary buffers with a pointer increment.
+// A caller takes a mark with arena_begin(), allocates freely, and drops
+// everything since the mark with arena_reset(); scopes nest, so a helper
+// can open its own scope inside a caller's.
+
+// Used until the first process exists
+static arena_t boot_arena;
+
+// Scratch arena of the running process
+arena_t* arena_current(void) {
+    process_t* proc = process_get_current();
+    return proc ? &proc->scratch : &boot_arena;
+}
+
+arena_mark_t arena_begin(arena_t* arena) {
+    return arena->top;
+}
+
+void* arena_alloc(arena_t* arena, size_t size) {
+    if (!arena->base) {
+        arena->base = (uint8_t*)vmalloc(ARENA_SIZE);
+        if (!arena->base) return NULL;
+        arena->size = ARENA_SIZE;
+        arena->top = 0;
+    }
+
+    size = (size + 15) & ~15;
+    if (size > arena->size - arena->top) return NULL;
+
+    void* ptr = arena->base + arena->top;
+    arena->top += size;
+    return ptr;
+}
+
+void arena_reset(arena_t* arena, arena_mark_t mark) {
+    if (mark < arena->top) {
+        arena->top = mark;
+    }
+}
+
+// Release the arena's pages
+void arena_destroy(arena_t* arena) {
+    vfree(arena->base);
+    arena->base = NULL;
+    arena->size = 0;
+    arena->top = 0;
+}
@@ -0,0 +1,23 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "types.h"
+
+#define ARENA_SIZE (64 * 1024)
+
+// Bump-pointer scratch arena for memory that lives for one operation
+typedef struct arena {
+    uint8_t* base;      // Scratch pages, allocated on first use
+    uint32_t size;
+    uint32_t top;       // Offset of the next free byte
+} arena_t;
+
+typedef uint32_t arena_mark_t;
+
+arena_t* arena_current(void);
+arena_mark_t arena_begin(arena_t* arena);
+void* arena_alloc(arena_t* arena, size_t size);
+void arena_reset(arena_t* arena, arena_mark_t mark);
+void arena_destroy(arena_t* arena);
+
+#endif
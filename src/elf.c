@@ -3,6 +3,8 @@
 #include "heap.h"
 #include "paging.h"
 #include "process.h"
+#include "arena.h"
+#include "vma.h"
 
 extern void log_info(const char* msg);
 
@@ -23,44 +25,57 @@ int elf_exec(const char* path) {
     elf_header_t header;
     if (vfs_read(file, 0, sizeof(elf_header_t), (uint8_t*)&header) != sizeof(elf_header_t)) {
         log_info("ELF: Failed to read header");
+        kfree(file);
         return -1;
     }
     
     // Validate ELF magic
     if (header.magic != ELF_MAGIC) {
         log_info("ELF: Invalid magic number");
+        kfree(file);
         return -1;
     }
     
     // Validate architecture
     if (header.machine != EM_386) {
         log_info("ELF: Not i386 executable");
+        kfree(file);
         return -1;
     }
     
     // Validate type
     if (header.type != ET_EXEC) {
         log_info("ELF: Not executable file");
+        kfree(file);
         return -1;
     }
     
     log_info("ELF: Valid executable detected");
     
-    // Read program headers
-    elf_program_header_t* pheaders = (elf_program_header_t*)kmalloc(header.phnum * sizeof(elf_program_header_t));
+    // Read program headers into scratch memory
+    arena_t* scratch = arena_current();
+    arena_mark_t mark = arena_begin(scratch);
+    elf_program_header_t* pheaders = (elf_program_header_t*)arena_alloc(scratch, header.phnum * sizeof(elf_program_header_t));
     if (!pheaders) {
         log_info("ELF: Out of memory");
+        kfree(file);
         return -1;
     }
     
     if (vfs_read(file, header.phoff, header.phnum * sizeof(elf_program_header_t), (uint8_t*)pheaders) 
         != header.phnum * sizeof(elf_program_header_t)) {
         log_info("ELF: Failed to read program headers");
-        kfree(pheaders);
+        arena_reset(scratch, mark);
+        kfree(file);
         return -1;
     }
     
-    // Load segments into memory
+    // The new areas are collected apart from the current ones, so a
+    // binary that turns out not to be loadable leaves the caller intact
+    vm_area_t* image = NULL;
+    
+    // Register each segment as memory areas; pages are read from the file
+    // or zero-filled when first touched
     for (int i = 0; i < header.phnum; i++) {
         if (pheaders[i].type != PT_LOAD) continue;
         
@@ -69,56 +84,65 @@ int elf_exec(const char* path) {
         uint32_t filesz = pheaders[i].filesz;
         uint32_t offset = pheaders[i].offset;
         
+        // File pages are mapped whole, so the file offset must sit at the
+        // same place in its page as the address
+        if ((vaddr & 0xFFF) != (offset & 0xFFF)) {
+            log_info("ELF: Misaligned segment");
+            vma_free_all(&image);
+            arena_reset(scratch, mark);
+            kfree(file);
+            return -1;
+        }
+        
         // Calculate page-aligned addresses
         uint32_t page_start = vaddr & 0xFFFFF000;
+        uint32_t file_end = (vaddr + filesz + 0xFFF) & 0xFFFFF000;
         uint32_t page_end = (vaddr + memsz + 0xFFF) & 0xFFFFF000;
-        uint32_t num_pages = (page_end - page_start) / PAGE_SIZE;
+        uint32_t lead = vaddr - page_start;
         
-        // Allocate and map pages with USER permission
-        for (uint32_t j = 0; j < num_pages; j++) {
-            uint32_t page_vaddr = page_start + (j * PAGE_SIZE);
-            uint32_t page_paddr = pmm_alloc_page();
-            if (!page_paddr) {
-                log_info("ELF: Out of physical memory");
-                kfree(pheaders);
-                return -1;
-            }
-            
-            // Map with user permission
-            uint32_t flags = PAGE_PRESENT | PAGE_USER;
-            if (pheaders[i].flags & PF_W) flags |= PAGE_WRITE;
-            
-            paging_map_page(page_vaddr, page_paddr, flags);
-        }
+        uint32_t vm_flags = VM_READ;
+        if (pheaders[i].flags & PF_W) vm_flags |= VM_WRITE;
+        if (pheaders[i].flags & PF_X) vm_flags |= VM_EXEC;
         
-        // Read segment data
+        // File data, then BSS pages past it as demand-zero memory. The
+        // last file page is zeroed beyond filesz.
+        bool ok = true;
         if (filesz > 0) {
-            vfs_read(file, offset, filesz, (uint8_t*)vaddr);
+            ok = vma_map(&image, page_start, file_end, vm_flags, VMA_FILE, file,
+                         offset - lead, filesz + lead) != NULL;
+        } else {
+            file_end = page_start;
         }
-        
-        // Zero out BSS (uninitialized data)
-        if (memsz > filesz) {
-            uint8_t* bss = (uint8_t*)(vaddr + filesz);
-            for (uint32_t j = 0; j < memsz - filesz; j++) {
-                bss[j] = 0;
-            }
+        if (ok && page_end > file_end) {
+            ok = vma_map(&image, file_end, page_end, vm_flags, VMA_ANON, NULL, 0, 0) != NULL;
+        }
+        if (!ok) {
+            log_info("ELF: Bad segment layout");
+            vma_free_all(&image);
+            arena_reset(scratch, mark);
+            kfree(file);
+            return -1;
         }
     }
     
-    kfree(pheaders);
+    arena_reset(scratch, mark);
+    kfree(file);  // The areas keep their own copies of the node
     
-    // Allocate user stack (8KB)
-    uint32_t stack_base = 0xC0000000;  // Stack at 3GB
+    // User stack (8KB to start with), also populated on demand
+    uint32_t stack_base = USER_STACK_TOP;  // Stack at 3GB
     uint32_t stack_pages = 2;
-    for (uint32_t i = 0; i < stack_pages; i++) {
-        uint32_t page_paddr = pmm_alloc_page();
-        if (!page_paddr) {
-            log_info("ELF: Out of memory for stack");
-            return -1;
-        }
-        paging_map_page(stack_base - (i + 1) * PAGE_SIZE, page_paddr, PAGE_PRESENT | PAGE_WRITE | PAGE_USER);
+    if (!vma_map(&image, stack_base - stack_pages * PAGE_SIZE, stack_base,
+                 VM_READ | VM_WRITE | VM_GROWSDOWN, VMA_ANON, NULL, 0, 0)) {
+        log_info("ELF: Out of memory for stack");
+        vma_free_all(&image);
+        return -1;
     }
     
+    // The old image goes; from here on there is nothing to return to
+    process_t* proc = process_get_current();
+    vma_unmap_all(proc);
+    proc->vmas = image;
+    
     uint32_t stack_top = stack_base;
     
     log_info("ELF: Jumping to userspace...");
@@ -2,6 +2,8 @@
 #include "ata.h"
 #include "vfs.h"
 #include "heap.h"
+#include "slab.h"
+#include "arena.h"
 
 // Extern logging
 extern void log_info(const char* msg);
@@ -31,6 +33,11 @@ static uint32_t fat_start_sector;
 static uint32_t data_start_sector;
 static uint32_t root_cluster;
 
+// Object cache for the dirents the driver hands out; nodes come from the
+// VFS node cache. Scratch sector and cluster buffers come from the
+// caller's arena.
+static kmem_cache_t* dirent_cache;
+
 // Helper to read a cluster
 static bool read_cluster(uint32_t cluster, uint8_t* buffer) {
     uint32_t lba = data_start_sector + (cluster - 2) * bpb.sectors_per_cluster;
@@ -43,16 +50,17 @@ static uint32_t get_next_cluster(uint32_t cluster) {
     uint32_t fat_sector = fat_start_sector + (fat_offset / bpb.bytes_per_sector);
     uint32_t ent_offset = fat_offset % bpb.bytes_per_sector;
     
-    uint8_t* buffer = (uint8_t*)kmalloc(512);
-    if (!ata_read_sectors(0, fat_sector, 1, buffer)) {
-        kfree(buffer);
-        return 0x0FFFFFFF;
-    }
+    arena_t* scratch = arena_current();
+    arena_mark_t mark = arena_begin(scratch);
+    uint8_t* buffer = (uint8_t*)arena_alloc(scratch, 512);
+    uint32_t next_cluster = 0x0FFFFFFF;
     
-    uint32_t next_cluster = *(uint32_t*)&buffer[ent_offset];
-    next_cluster &= 0x0FFFFFFF;
+    if (buffer && ata_read_sectors(0, fat_sector, 1, buffer)) {
+        next_cluster = *(uint32_t*)&buffer[ent_offset];
+        next_cluster &= 0x0FFFFFFF;
+    }
     
-    kfree(buffer);
+    arena_reset(scratch, mark);
     return next_cluster;
 }
 
@@ -69,7 +77,10 @@ static uint32_t fat32_read(fs_node_t* node, uint32_t offset, uint32_t size, uint
     }
     
     uint32_t read_size = 0;
-    uint8_t* cluster_buffer = (uint8_t*)kmalloc(cluster_size);
+    arena_t* scratch = arena_current();
+    arena_mark_t mark = arena_begin(scratch);
+    uint8_t* cluster_buffer = (uint8_t*)arena_alloc(scratch, cluster_size);
+    if (!cluster_buffer) return 0;
     
     while (size > 0) {
         if (!read_cluster(cluster, cluster_buffer)) {
@@ -93,7 +104,7 @@ static uint32_t fat32_read(fs_node_t* node, uint32_t offset, uint32_t size, uint
         }
     }
     
-    kfree(cluster_buffer);
+    arena_reset(scratch, mark);
     return read_size;
 }
 
@@ -115,7 +126,9 @@ static struct dirent* fat32_readdir(fs_node_t* node, uint32_t index) {
         log_info(buf);
     }
     
-    uint8_t* buffer = (uint8_t*)kmalloc(cluster_size);
+    arena_t* scratch = arena_current();
+    arena_mark_t mark = arena_begin(scratch);
+    uint8_t* buffer = (uint8_t*)arena_alloc(scratch, cluster_size);
     if (!buffer) {
         log_info("FAT32: readdir OOM");
         return 0;
@@ -126,7 +139,7 @@ static struct dirent* fat32_readdir(fs_node_t* node, uint32_t index) {
     while (cluster < 0x0FFFFFF8) {
         if (!read_cluster(cluster, buffer)) {
             log_info("FAT32: read_cluster failed");
-            kfree(buffer);
+            arena_reset(scratch, mark);
             break;
         }
         
@@ -134,14 +147,18 @@ static struct dirent* fat32_readdir(fs_node_t* node, uint32_t index) {
         
         for (uint32_t i = 0; i < dir_entries_per_cluster; i++) {
             if (entries[i].name[0] == 0x00) { // End of dir
-                kfree(buffer);
+                arena_reset(scratch, mark);
                 return 0;
             }
             if (entries[i].name[0] == 0xE5) continue; // Deleted
             if (entries[i].attr & ATTR_LONG_NAME) continue; // Skip LFN for now
             
             if (current_index == index) {
-                struct dirent* dirent = (struct dirent*)kmalloc(sizeof(struct dirent));
+                struct dirent* dirent = (struct dirent*)kmem_cache_alloc(dirent_cache);
+                if (!dirent) {
+                    arena_reset(scratch, mark);
+                    return 0;
+                }
                 
                 // Copy name
                 int j = 0;
@@ -157,7 +174,7 @@ static struct dirent* fat32_readdir(fs_node_t* node, uint32_t index) {
                 dirent->name[j] = 0;
                 
                 dirent->inode = (entries[i].fst_clus_hi << 16) | entries[i].fst_clus_lo;
-                kfree(buffer);
+                arena_reset(scratch, mark);
                 return dirent;
             }
             current_index++;
@@ -166,7 +183,7 @@ static struct dirent* fat32_readdir(fs_node_t* node, uint32_t index) {
         cluster = get_next_cluster(cluster);
     }
     
-    kfree(buffer);
+    arena_reset(scratch, mark);
     return 0;
 }
 
@@ -175,7 +192,10 @@ static fs_node_t* fat32_finddir(fs_node_t* node, char* name) {
     uint32_t cluster_size = bpb.sectors_per_cluster * bpb.bytes_per_sector;
     uint32_t dir_entries_per_cluster = cluster_size / sizeof(fat_dir_entry_t);
     
-    uint8_t* buffer = (uint8_t*)kmalloc(cluster_size);
+    arena_t* scratch = arena_current();
+    arena_mark_t mark = arena_begin(scratch);
+    uint8_t* buffer = (uint8_t*)arena_alloc(scratch, cluster_size);
+    if (!buffer) return 0;
     
     while (cluster < 0x0FFFFFF8) {
         if (!read_cluster(cluster, buffer)) break;
@@ -184,7 +204,7 @@ static fs_node_t* fat32_finddir(fs_node_t* node, char* name) {
         
         for (uint32_t i = 0; i < dir_entries_per_cluster; i++) {
             if (entries[i].name[0] == 0x00) {
-                kfree(buffer);
+                arena_reset(scratch, mark);
                 return 0;
             }
             if (entries[i].name[0] == 0xE5) continue;
@@ -213,20 +233,24 @@ static fs_node_t* fat32_finddir(fs_node_t* node, char* name) {
             }
             
             if (match) {
-                fs_node_t* file_node = (fs_node_t*)kmalloc(sizeof(fs_node_t));
+                fs_node_t* file_node = vfs_node_alloc();
+                if (!file_node) break;
                 file_node->inode = (entries[i].fst_clus_hi << 16) | entries[i].fst_clus_lo;
                 file_node->length = entries[i].file_size;
                 
                 if (entries[i].attr & ATTR_DIRECTORY) {
                     file_node->flags = FS_DIRECTORY;
+                    file_node->read = 0;
                     file_node->readdir = fat32_readdir;
                     file_node->finddir = fat32_finddir;
                 } else {
                     file_node->flags = FS_FILE;
                     file_node->read = fat32_read;
+                    file_node->readdir = 0;
+                    file_node->finddir = 0;
                 }
                 
-                kfree(buffer);
+                arena_reset(scratch, mark);
                 return file_node;
             }
         }
@@ -234,23 +258,31 @@ static fs_node_t* fat32_finddir(fs_node_t* node, char* name) {
         cluster = get_next_cluster(cluster);
     }
     
-    kfree(buffer);
+    arena_reset(scratch, mark);
     return 0;
 }
 
 void fat32_init(void) {
     log_info("FAT32: Initializing...");
     
-    uint8_t* sector0 = (uint8_t*)kmalloc(512);
-    if (!ata_read_sectors(0, 0, 1, sector0)) {
+    dirent_cache = kmem_cache_create("dirent", sizeof(struct dirent), 0, NULL);
+    if (!dirent_cache) {
+        log_info("FAT32: Failed to create dirent cache");
+        return;
+    }
+
+    arena_t* scratch = arena_current();
+    arena_mark_t mark = arena_begin(scratch);
+    uint8_t* sector0 = (uint8_t*)arena_alloc(scratch, 512);
+    if (!sector0 || !ata_read_sectors(0, 0, 1, sector0)) {
         log_info("FAT32: Failed to read boot sector");
-        kfree(sector0);
+        arena_reset(scratch, mark);
         return;
     }
 
     fat_bpb_t* bpb_ptr = (fat_bpb_t*)sector0;
     bpb = *bpb_ptr;
-    kfree(sector0);
+    arena_reset(scratch, mark);
 
     // Validate BPB to prevent divide-by-zero
     if (bpb.bytes_per_sector == 0 || bpb.sectors_per_cluster == 0) {
@@ -271,7 +303,8 @@ void fat32_init(void) {
     log_info("FAT32: Volume found");
 
     // Setup root node
-    fs_root = (fs_node_t*)kmalloc(sizeof(fs_node_t));
+    fs_root = vfs_node_alloc();
+    if (!fs_root) return;
     fs_root->inode = root_cluster;
     fs_root->flags = FS_DIRECTORY;
     fs_root->readdir = fat32_readdir;
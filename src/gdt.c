@@ -42,6 +42,15 @@ void write_tss(int32_t num, uint16_t ss0, uint32_t esp0) {
     tss_entry.gs = 0x13;
 }
 
+// Stack the CPU switches to on an interrupt from user mode
+void tss_set_kernel_stack(uint32_t esp0) {
+    tss_entry.esp0 = esp0;
+}
+
+uint32_t tss_get_kernel_stack(void) {
+    return tss_entry.esp0;
+}
+
 void gdt_init(void) {
     gp.limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
     gp.base  = (uint32_t)&gdt;
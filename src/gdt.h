@@ -45,6 +45,8 @@ struct tss_entry_struct {
 typedef struct tss_entry_struct tss_entry_t;
 
 void write_tss(int32_t num, uint16_t ss0, uint32_t esp0);
+void tss_set_kernel_stack(uint32_t esp0);
+uint32_t tss_get_kernel_stack(void);
 
 struct gdt_ptr {
     uint16_t limit;
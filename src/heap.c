@@ -2,132 +2,370 @@
 #include "types.h"
 #include "pmm.h"
 #include "paging.h"
+#include "slab.h"
+#include "vmalloc.h"
 
-// Simple block-based heap allocator
+// Two-level segregated fit (TLSF) heap allocator. Free blocks sit on
+// per-size-class lists indexed by a first level (power of two) and a
+// second level (linear split of that range); bitmaps of non-empty lists
+// make both kmalloc and kfree bounded-time.
+
+extern void log_info(const char* msg);
+extern void log_value(const char* label, uint32_t value, bool hex);
 
 struct heap_block {
-    uint32_t size;       // Size of this block (including header)
-    uint32_t is_free;    // Is this block free?
-    struct heap_block* next;
-    struct heap_block* prev;
+    struct heap_block* prev_phys;  // Block just before this one in memory
+    uint32_t size;                 // Size including header; BLOCK_FREE set while free
+#ifdef HEAP_PROFILE
+    uint32_t caller;               // Return address of the allocating call
+    uint32_t seq;                  // Allocation sequence number
+#endif
+    struct heap_block* next_free;  // Free list links, valid only while free
+    struct heap_block* prev_free;
 };
 
-#define BLOCK_HEADER_SIZE sizeof(struct heap_block)
-#define MIN_BLOCK_SIZE (BLOCK_HEADER_SIZE + 16)
+#define BLOCK_FREE 0x1
+#define BLOCK_HEADER_SIZE __builtin_offsetof(struct heap_block, next_free)  // Links overlap user data
+#define MIN_BLOCK_SIZE sizeof(struct heap_block)
+
+#define SL_LOG2 4
+#define SL_COUNT (1 << SL_LOG2)
+#define FL_SHIFT (SL_LOG2 + 3)     // Sizes below 1 << FL_SHIFT share first level 0
+#define SMALL_BLOCK (1 << FL_SHIFT)
+#define FL_COUNT (32 - FL_SHIFT + 1)
+
+#define HEAP_MAX_SIZE 0x10000000          // Heap may grow up to 256 MB
+#define HEAP_GROW_MIN (16 * PAGE_SIZE)    // Smallest growth step, also kept as tail slack
+#define HEAP_TRIM_THRESHOLD (64 * PAGE_SIZE)
 
 static struct heap_block* heap_start = NULL;
-static struct heap_block* heap_end = NULL;
+static struct heap_block* heap_last = NULL;   // Block that ends at the top of the heap
 static uint32_t heap_size = 0;
 static uint32_t heap_used = 0;
 static uint32_t heap_virt_start = 0;
+static uint32_t heap_min_size = 0;            // Initial heap, never returned to the PMM
+static uint32_t heap_peak = 0;
 
-void heap_init(uint32_t start, uint32_t size) {
-    heap_virt_start = start;
-    heap_start = (struct heap_block*)start;
-    heap_size = size;
-    heap_used = BLOCK_HEADER_SIZE;
+#ifdef HEAP_PROFILE
+// Per-callsite accounting, hashed by caller address. Build with
+// DEFINES=-DHEAP_PROFILE.
+#define PROFILE_SITES 128
+#define PROFILE_LEAK_LINES 32
 
-    // Initialize first block as one large free block
-    heap_start->size = size;
-    heap_start->is_free = 1;
-    heap_start->next = NULL;
-    heap_start->prev = NULL;
+struct heap_site {
+    uint32_t caller;
+    uint32_t live_blocks;
+    uint32_t live_bytes;
+    uint32_t total_allocs;
+};
 
-    heap_end = heap_start;
-}
+static struct heap_site heap_sites[PROFILE_SITES];
+static uint32_t heap_alloc_seq = 0;
+static uint32_t heap_report_seq = 0;   // Blocks before this were in an earlier report
 
-static struct heap_block* find_free_block(size_t size) {
-    struct heap_block* current = heap_start;
-    
-    while (current) {
-        if (current->is_free && current->size >= size + BLOCK_HEADER_SIZE) {
-            return current;
+static struct heap_site* site_lookup(uint32_t caller) {
+    uint32_t slot = (caller >> 2) % PROFILE_SITES;
+    for (uint32_t i = 0; i < PROFILE_SITES; i++) {
+        struct heap_site* site = &heap_sites[(slot + i) % PROFILE_SITES];
+        if (site->caller == caller) return site;
+        if (site->caller == 0) {
+            site->caller = caller;
+            return site;
         }
-        current = current->next;
     }
-    
-    return NULL;
+    return NULL;  // Table full; the site goes untracked
 }
+#endif
 
-static void split_block(struct heap_block* block, size_t size) {
-    size_t total_needed = size + BLOCK_HEADER_SIZE;
-    
-    // Only split if remaining space is large enough
-    if (block->size >= total_needed + MIN_BLOCK_SIZE) {
-        struct heap_block* new_block = (struct heap_block*)((uint8_t*)block + total_needed);
-        
-        new_block->size = block->size - total_needed;
-        new_block->is_free = 1;
-        new_block->next = block->next;
-        new_block->prev = block;
-        
-        if (block->next) {
-            block->next->prev = new_block;
+static uint32_t fl_bitmap = 0;
+static uint32_t sl_bitmap[FL_COUNT];
+static struct heap_block* free_lists[FL_COUNT][SL_COUNT];
+
+static inline uint32_t block_size(struct heap_block* block) {
+    return block->size & ~BLOCK_FREE;
+}
+
+static inline bool block_is_free(struct heap_block* block) {
+    return block->size & BLOCK_FREE;
+}
+
+static inline struct heap_block* block_next_phys(struct heap_block* block) {
+    if (block == heap_last) return NULL;
+    return (struct heap_block*)((uint8_t*)block + block_size(block));
+}
+
+static inline uint32_t fls(uint32_t value) {
+    return 31 - __builtin_clz(value);
+}
+
+static void size_mapping(uint32_t size, uint32_t* fl, uint32_t* sl) {
+    if (size < SMALL_BLOCK) {
+        *fl = 0;
+        *sl = size / (SMALL_BLOCK / SL_COUNT);
+    } else {
+        uint32_t f = fls(size);
+        *sl = (size >> (f - SL_LOG2)) ^ SL_COUNT;
+        *fl = f - (FL_SHIFT - 1);
+    }
+}
+
+static void free_list_insert(struct heap_block* block) {
+    uint32_t fl, sl;
+    size_mapping(block_size(block), &fl, &sl);
+
+    block->prev_free = NULL;
+    block->next_free = free_lists[fl][sl];
+    if (block->next_free) block->next_free->prev_free = block;
+    free_lists[fl][sl] = block;
+
+    fl_bitmap |= 1u << fl;
+    sl_bitmap[fl] |= 1u << sl;
+}
+
+static void free_list_remove(struct heap_block* block) {
+    uint32_t fl, sl;
+    size_mapping(block_size(block), &fl, &sl);
+
+    if (block->prev_free) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        free_lists[fl][sl] = block->next_free;
+    }
+    if (block->next_free) block->next_free->prev_free = block->prev_free;
+
+    if (!free_lists[fl][sl]) {
+        sl_bitmap[fl] &= ~(1u << sl);
+        if (!sl_bitmap[fl]) fl_bitmap &= ~(1u << fl);
+    }
+}
+
+// Round size up to the next class so any block on that class's list fits
+static uint32_t size_round(uint32_t size) {
+    if (size >= SMALL_BLOCK) {
+        size += (1u << (fls(size) - SL_LOG2)) - 1;
+    }
+    return size;
+}
+
+// Find a free block of at least size bytes without walking any list
+static struct heap_block* find_free_block(uint32_t size) {
+    size = size_round(size);
+
+    uint32_t fl, sl;
+    size_mapping(size, &fl, &sl);
+    if (fl >= FL_COUNT) return NULL;
+
+    uint32_t sl_map = sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        uint32_t fl_map = fl_bitmap & (~0u << (fl + 1));
+        if (!fl_map) return NULL;
+        fl = __builtin_ctz(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+
+    struct heap_block* block = free_lists[fl][sl];
+    free_list_remove(block);
+    return block;
+}
+
+// Trim block to size bytes, returning the remainder to the free lists
+static void split_block(struct heap_block* block, uint32_t size) {
+    uint32_t total = block_size(block);
+    if (total < size + MIN_BLOCK_SIZE) return;
+
+    struct heap_block* rest = (struct heap_block*)((uint8_t*)block + size);
+    rest->prev_phys = block;
+    rest->size = (total - size) | BLOCK_FREE;
+
+    struct heap_block* next = block_next_phys(block);
+    if (next) {
+        next->prev_phys = rest;
+    } else {
+        heap_last = rest;
+    }
+
+    block->size = size | (block->size & BLOCK_FREE);
+    free_list_insert(rest);
+}
+
+// Grow block over its physical successor; neither may be on a free list
+static void absorb_next(struct heap_block* block) {
+    struct heap_block* next = block_next_phys(block);
+    struct heap_block* after = block_next_phys(next);
+
+    block->size += block_size(next);
+    if (after) {
+        after->prev_phys = block;
+    } else {
+        heap_last = block;
+    }
+}
+
+// Mark block free, coalesce with its neighbours and file it by size
+static void release_block(struct heap_block* block) {
+    block->size |= BLOCK_FREE;
+
+    struct heap_block* next = block_next_phys(block);
+    if (next && block_is_free(next)) {
+        free_list_remove(next);
+        absorb_next(block);
+    }
+
+    struct heap_block* prev = block->prev_phys;
+    if (prev && block_is_free(prev)) {
+        free_list_remove(prev);
+        absorb_next(prev);
+        block = prev;
+    }
+
+    free_list_insert(block);
+}
+
+// Return the frames under count heap pages at virt and unmap them
+static void heap_release_pages(uint32_t virt, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        pmm_free_page(paging_get_physical(virt + i * PAGE_SIZE));
+    }
+    paging_unmap_range(virt, count);
+}
+
+// Extend the heap so a block of size bytes fits. Growth is geometric, so
+// a run of allocations maps pages in a few large steps; the new pages
+// coalesce with a free tail block.
+static bool heap_grow(uint32_t size) {
+    uint32_t need = size_round(size);
+    if (block_is_free(heap_last)) {
+        uint32_t tail = block_size(heap_last);
+        need = (tail < need) ? need - tail : 0;
+    }
+    need = (need + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    uint32_t grow = (heap_size / 2) & ~(PAGE_SIZE - 1);
+    if (grow < HEAP_GROW_MIN) grow = HEAP_GROW_MIN;
+    if (grow < need) grow = need;
+    if (heap_size + grow > HEAP_MAX_SIZE) grow = HEAP_MAX_SIZE - heap_size;
+    if (grow < need || grow == 0) return false;
+
+    uint32_t top = heap_virt_start + heap_size;
+    uint32_t mapped = 0;
+
+    // One contiguous run maps with a single range call
+    uint32_t phys = pmm_alloc_pages(grow / PAGE_SIZE);
+    if (phys && paging_map_range(top, phys, grow / PAGE_SIZE, PAGE_PRESENT | PAGE_WRITE)) {
+        mapped = grow;
+    } else {
+        if (phys) {
+            paging_unmap_range(top, grow / PAGE_SIZE);
+            pmm_free_pages(phys, grow / PAGE_SIZE);
         }
-        
-        block->size = total_needed;
-        block->next = new_block;
-        
-        if (block == heap_end) {
-            heap_end = new_block;
+        while (mapped < grow) {
+            phys = pmm_alloc_high_page();
+            if (!phys) break;
+            if (!paging_map_page(top + mapped, phys, PAGE_PRESENT | PAGE_WRITE)) {
+                pmm_free_page(phys);
+                break;
+            }
+            mapped += PAGE_SIZE;
         }
     }
+
+    // Settle for less than a full step, but not less than the request
+    if (mapped < need || mapped == 0) {
+        heap_release_pages(top, mapped / PAGE_SIZE);
+        return false;
+    }
+
+    struct heap_block* block = (struct heap_block*)top;
+    block->prev_phys = heap_last;
+    block->size = mapped;
+    heap_last = block;
+    heap_size += mapped;
+    release_block(block);
+    return true;
 }
 
-static void merge_free_blocks(struct heap_block* block) {
-    // Merge with next block if free
-    if (block->next && block->next->is_free) {
-        block->size += block->next->size;
-        block->next = block->next->next;
-        
-        if (block->next) {
-            block->next->prev = block;
-        } else {
-            heap_end = block;
+// Give pages under a large free tail back to the PMM, keeping some slack
+static void heap_trim(void) {
+    struct heap_block* tail = heap_last;
+    if (!block_is_free(tail) || block_size(tail) < HEAP_TRIM_THRESHOLD) return;
+
+    uint32_t top = heap_virt_start + heap_size;
+    uint32_t keep = ((uint32_t)tail + MIN_BLOCK_SIZE + HEAP_GROW_MIN + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (keep < heap_virt_start + heap_min_size) keep = heap_virt_start + heap_min_size;
+    if (keep >= top) return;
+
+    free_list_remove(tail);
+    tail->size = (keep - (uint32_t)tail) | BLOCK_FREE;
+    free_list_insert(tail);
+    heap_size = keep - heap_virt_start;
+
+    heap_release_pages(keep, (top - keep) / PAGE_SIZE);
+}
+
+void heap_init(uint32_t start, uint32_t size) {
+    heap_virt_start = start;
+    heap_start = (struct heap_block*)start;
+    heap_size = size;
+    heap_min_size = size;
+    heap_used = 0;
+
+    for (int i = 0; i < FL_COUNT; i++) {
+        sl_bitmap[i] = 0;
+        for (int j = 0; j < SL_COUNT; j++) {
+            free_lists[i][j] = NULL;
         }
     }
-    
-    // Merge with previous block if free
-    if (block->prev && block->prev->is_free) {
-        block->prev->size += block->size;
-        block->prev->next = block->next;
-        
-        if (block->next) {
-            block->next->prev = block->prev;
-        } else {
-            heap_end = block->prev;
-        }
+    fl_bitmap = 0;
+
+    // Initialize first block as one large free block
+    heap_start->prev_phys = NULL;
+    heap_start->size = size | BLOCK_FREE;
+    heap_last = heap_start;
+    free_list_insert(heap_start);
+}
+
+// Block size, header included, for a request; 0 if it can never fit
+static uint32_t block_size_for(size_t size) {
+    if (size == 0 || size > HEAP_MAX_SIZE) return 0;
+
+    // Align size to 8 bytes and add the header
+    size = ((size + 7) & ~7) + BLOCK_HEADER_SIZE;
+    if (size < MIN_BLOCK_SIZE) size = MIN_BLOCK_SIZE;
+    return size;
+}
+
+// Take a free block off the heap, trimmed to size bytes, for the caller
+static void* use_block(struct heap_block* block, uint32_t size, void* caller) {
+    split_block(block, size);
+    block->size &= ~BLOCK_FREE;
+    heap_used += block_size(block);
+    if (heap_used > heap_peak) heap_peak = heap_used;
+
+#ifdef HEAP_PROFILE
+    block->caller = (uint32_t)caller;
+    block->seq = heap_alloc_seq++;
+    struct heap_site* site = site_lookup(block->caller);
+    if (site) {
+        site->live_blocks++;
+        site->live_bytes += block_size(block);
+        site->total_allocs++;
     }
+#else
+    (void)caller;
+#endif
+
+    // Return pointer to usable memory (after header)
+    return (void*)((uint8_t*)block + BLOCK_HEADER_SIZE);
 }
 
-void* kmalloc(size_t size) {
-    if (size == 0) return NULL;
-    
-    // Align size to 8 bytes
-    size = (size + 7) & ~7;
+static void* heap_alloc(size_t size, void* caller) {
+    size = block_size_for(size);
+    if (!size) return NULL;
     
     struct heap_block* block = find_free_block(size);
     
-    if (!block) {
-        // Expand heap
-        uint32_t phys = pmm_alloc_page();
-        if (!phys) return NULL;
-        
-        uint32_t new_virt = heap_virt_start + heap_size;
-        paging_map_page(new_virt, phys, PAGE_PRESENT | PAGE_WRITE);
-        
-        heap_size += PAGE_SIZE;
-        
-        // Append new free block
-        struct heap_block* new_block = (struct heap_block*)new_virt;
-        new_block->size = PAGE_SIZE;
-        new_block->is_free = 1;
-        new_block->next = NULL;
-        new_block->prev = heap_end;
-        if (heap_end) heap_end->next = new_block;
-        heap_end = new_block;
-        
-        // Retry allocation
+    if (!block && heap_grow(size)) {
         block = find_free_block(size);
     }
     
@@ -135,29 +373,54 @@ void* kmalloc(size_t size) {
         return NULL;
     }
     
-    split_block(block, size);
-    block->is_free = 0;
-    heap_used += block->size;
-    
-    // Return pointer to usable memory (after header)
-    return (void*)((uint8_t*)block + BLOCK_HEADER_SIZE);
+    return use_block(block, size, caller);
 }
 
+void* kmalloc(size_t size) {
+    return heap_alloc(size, __builtin_return_address(0));
+}
+
+// Aligned allocation carved from a free block; the result has a normal
+// block header, so it is released with kfree().
 void* kmalloc_aligned(size_t size, size_t alignment) {
-    // Allocate extra space for alignment
-    size_t total = size + alignment - 1 + sizeof(void*);
-    void* ptr = kmalloc(total);
-    
-    if (!ptr) return NULL;
-    
-    // Calculate aligned address
-    uintptr_t addr = (uintptr_t)ptr + sizeof(void*);
-    uintptr_t aligned = (addr + alignment - 1) & ~(alignment - 1);
-    
-    // Store original pointer before aligned address
-    ((void**)aligned)[-1] = ptr;
-    
-    return (void*)aligned;
+    if (alignment <= 8) return heap_alloc(size, __builtin_return_address(0));
+    if (alignment & (alignment - 1)) return NULL;
+
+    size = block_size_for(size);
+    if (!size || alignment > HEAP_MAX_SIZE) return NULL;
+
+    // Enough room to skip ahead to an aligned payload and free the gap
+    uint32_t search = size + alignment + MIN_BLOCK_SIZE;
+    struct heap_block* block = find_free_block(search);
+    if (!block && heap_grow(search)) {
+        block = find_free_block(search);
+    }
+    if (!block) return NULL;
+
+    uint32_t payload = (uint32_t)block + BLOCK_HEADER_SIZE;
+    uint32_t gap = ((payload + alignment - 1) & ~(alignment - 1)) - payload;
+    if (gap && gap < MIN_BLOCK_SIZE) gap += alignment;
+
+    if (gap) {
+        // Split the leading gap off as a free block of its own. Its
+        // physical predecessor is in use, or it would have coalesced.
+        struct heap_block* front = block;
+        struct heap_block* next = block_next_phys(front);
+
+        block = (struct heap_block*)((uint8_t*)front + gap);
+        block->prev_phys = front;
+        block->size = (block_size(front) - gap) | BLOCK_FREE;
+        if (next) {
+            next->prev_phys = block;
+        } else {
+            heap_last = block;
+        }
+
+        front->size = gap | BLOCK_FREE;
+        free_list_insert(front);
+    }
+
+    return use_block(block, size, __builtin_return_address(0));
 }
 
 void kfree(void* ptr) {
@@ -169,17 +432,29 @@ void kfree(void* ptr) {
     // Validate block is within heap
     if ((uint8_t*)block < (uint8_t*)heap_start || 
         (uint8_t*)block >= (uint8_t*)heap_start + heap_size) {
-        return;  // Invalid pointer
+        // Slab and vmalloc memory may be released through kfree too
+        if (is_vmalloc_addr(ptr)) {
+            vfree(ptr);
+        } else {
+            kmem_free(ptr);
+        }
+        return;
     }
     
-    if (block->is_free) {
+    if (block_is_free(block)) {
         return;  // Already freed
     }
     
-    heap_used -= block->size;
-    block->is_free = 1;
-    
-    merge_free_blocks(block);
+    heap_used -= block_size(block);
+#ifdef HEAP_PROFILE
+    struct heap_site* site = site_lookup(block->caller);
+    if (site) {
+        site->live_blocks--;
+        site->live_bytes -= block_size(block);
+    }
+#endif
+    release_block(block);
+    heap_trim();
 }
 
 size_t heap_get_used(void) {
@@ -189,3 +464,84 @@ size_t heap_get_used(void) {
 size_t heap_get_free(void) {
     return heap_size - heap_used;
 }
+
+size_t heap_get_peak(void) {
+    return heap_peak;
+}
+
+// Largest free block, header included
+size_t heap_get_largest_free(void) {
+    if (!fl_bitmap) return 0;
+
+    // Only the highest non-empty class can hold the largest block
+    uint32_t fl = fls(fl_bitmap);
+    uint32_t sl = fls(sl_bitmap[fl]);
+    uint32_t largest = 0;
+    for (struct heap_block* block = free_lists[fl][sl]; block; block = block->next_free) {
+        if (block_size(block) > largest) largest = block_size(block);
+    }
+    return largest;
+}
+
+// Percentage of free heap memory lying outside the largest free block
+uint32_t heap_get_fragmentation(void) {
+    uint32_t free = heap_get_free();
+    if (!free) return 0;
+    return ((free - heap_get_largest_free()) * 100) / free;
+}
+
+// Dump heap usage, a free block size histogram and, with HEAP_PROFILE,
+// per-callsite totals and the blocks allocated since the previous dump
+// that are still live.
+void heap_dump_stats(void) {
+    log_info("Heap statistics:");
+    log_value("  size:          ", heap_size, false);
+    log_value("  used:          ", heap_used, false);
+    log_value("  peak:          ", heap_peak, false);
+    log_value("  free:          ", heap_get_free(), false);
+    log_value("  largest free:  ", heap_get_largest_free(), false);
+    log_value("  fragmentation (%): ", heap_get_fragmentation(), false);
+
+    // Free block histogram, one bucket per power of two
+    uint32_t buckets[32];
+    for (int i = 0; i < 32; i++) buckets[i] = 0;
+    for (struct heap_block* block = heap_start; block; block = block_next_phys(block)) {
+        if (block_is_free(block)) buckets[fls(block_size(block))]++;
+    }
+    log_info("  free blocks by size (bucket >= 2^n bytes):");
+    for (int i = 0; i < 32; i++) {
+        if (!buckets[i]) continue;
+        char label[24] = "    2^";
+        label[6] = '0' + i / 10;
+        label[7] = '0' + i % 10;
+        label[8] = ':';
+        label[9] = ' ';
+        label[10] = '\0';
+        log_value(label, buckets[i], false);
+    }
+
+#ifdef HEAP_PROFILE
+    log_info("  live allocations by callsite:");
+    for (int i = 0; i < PROFILE_SITES; i++) {
+        struct heap_site* site = &heap_sites[i];
+        if (!site->live_blocks) continue;
+        log_value("    caller ", site->caller, true);
+        log_value("      live blocks: ", site->live_blocks, false);
+        log_value("      live bytes:  ", site->live_bytes, false);
+        log_value("      total allocs: ", site->total_allocs, false);
+    }
+
+    log_info("  still live since last dump:");
+    uint32_t lines = 0;
+    for (struct heap_block* block = heap_start; block; block = block_next_phys(block)) {
+        if (block_is_free(block) || block->seq < heap_report_seq) continue;
+        if (lines++ == PROFILE_LEAK_LINES) {
+            log_info("    ...");
+            break;
+        }
+        log_value("    caller ", block->caller, true);
+        log_value("      bytes: ", block_size(block) - BLOCK_HEADER_SIZE, false);
+    }
+    heap_report_seq = heap_alloc_seq;
+#endif
+}
@@ -10,5 +10,9 @@ void* kmalloc_aligned(size_t size, size_t alignment);
 void kfree(void* ptr);
 size_t heap_get_used(void);
 size_t heap_get_free(void);
+size_t heap_get_peak(void);
+size_t heap_get_largest_free(void);
+uint32_t heap_get_fragmentation(void);
+void heap_dump_stats(void);
 
 #endif
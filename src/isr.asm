@@ -49,6 +49,11 @@ isr_common_stub:
     push esp
     call isr_handler
     add esp, 4
+
+; Return to the interrupted context described by the registers frame on
+; the stack. Forked processes start here.
+global isr_return
+isr_return:
     pop eax
     mov ds, ax
     mov es, ax
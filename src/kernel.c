@@ -17,6 +17,7 @@
 #include "fat32.h"
 #include "syscalls.h"
 #include "elf.h"
+#include "swap.h"
 
 // VGA text-mode driver
 static volatile char* const VGA_MEMORY = (char*)0xB8000;
@@ -338,6 +339,32 @@ void log_info(const char* msg) {
     vga_write_at(row, 7, msg);
 }
 
+// Log a label followed by a number, in decimal or as 0x-prefixed hex
+void log_value(const char* label, uint32_t value, bool hex) {
+    char buf[64];
+    int i = 0;
+    while (label[i] && i < 48) {
+        buf[i] = label[i];
+        i++;
+    }
+
+    if (!hex) {
+        uitoa(value, &buf[i]);
+    } else {
+        char tmp[8];
+        int n = 0;
+        buf[i++] = '0';
+        buf[i++] = 'x';
+        do {
+            tmp[n++] = "0123456789ABCDEF"[value & 0xF];
+            value >>= 4;
+        } while (value);
+        while (n) buf[i++] = tmp[--n];
+        buf[i] = '\0';
+    }
+    log_info(buf);
+}
+
 // External symbol for heap placement
 extern uint32_t _end;
 
@@ -377,8 +404,9 @@ void kmain(struct multiboot_info* mboot) {
     vga_write_at(24, 0, "Initializing PMM...");
     log_info("FlowOS: Initializing PMM...");
     pmm_init(mboot);
-
-
+#ifdef PMM_BENCH
+    pmm_benchmark();
+#endif
 
     // Initialize Paging
     vga_write_at(24, 0, "Initializing Paging...");
@@ -394,9 +422,7 @@ void kmain(struct multiboot_info* mboot) {
         log_info("Heap OOM");
         hlt();
     }
-    for (uint32_t i = 0; i < HEAP_PAGES; i++) {
-        paging_map_page(KERNEL_HEAP_VIRT + i * PAGE_SIZE, heap_phys + i * PAGE_SIZE, PAGE_PRESENT | PAGE_WRITE);
-    }
+    paging_map_range(KERNEL_HEAP_VIRT, heap_phys, HEAP_PAGES, PAGE_PRESENT | PAGE_WRITE);
 
     log_info("FlowOS: Initializing heap...");
     heap_init(KERNEL_HEAP_VIRT, HEAP_PAGES * PAGE_SIZE);
@@ -407,7 +433,11 @@ void kmain(struct multiboot_info* mboot) {
 
     // Initialize FAT32
     log_info("FlowOS: Initializing FAT32...");
+    vfs_init();
     fat32_init();
+
+    // Page out to a second ATA drive when memory runs short
+    swap_init();
     
     // Debug: List files in root directory
     log_info("FAT32: Files in root directory:");
@@ -0,0 +1,93 @@
+#include "pagecache.h"
+#include "pmm.h"
+#include "slab.h"
+
+// Frames holding file pages for mapping into user space, keyed by file
+// and offset. The cache holds one reference on each frame and every
+// mapping one more, so a page is shared by all processes mapping it and
+// outlives them for the next exec. Cached frames are never written:
+// writable mappings take a private copy on the first write.
+
+#define PAGECACHE_BUCKETS   256
+#define PAGECACHE_MAX_PAGES 4096  // 16MB; past this, adding drops unmapped pages
+#define PAGECACHE_TRIM      8     // Entries a full cache tries to drop per add
+
+struct cached_page {
+    uint32_t inode;             // File identity
+    uint32_t offset;            // Page-aligned file offset
+    uint32_t length;            // Bytes of file data; the rest is zero
+    uint32_t frame;
+    struct cached_page* next;   // Hash chain
+};
+
+static struct cached_page* buckets[PAGECACHE_BUCKETS];
+static kmem_cache_t* cached_page_cache;
+static uint32_t cached_pages = 0;
+
+void pagecache_init(void) {
+    cached_page_cache = kmem_cache_create("cached_page", sizeof(struct cached_page), 0, NULL);
+}
+
+static inline uint32_t pagecache_hash(uint32_t inode, uint32_t offset) {
+    return (inode * 31 + offset / PAGE_SIZE) % PAGECACHE_BUCKETS;
+}
+
+// Frame caching the given page, with a reference taken for the caller,
+// or 0 if it is not cached
+uint32_t pagecache_find(fs_node_t* file, uint32_t offset, uint32_t length) {
+    struct cached_page* entry = buckets[pagecache_hash(file->inode, offset)];
+    for (; entry; entry = entry->next) {
+        if (entry->inode == file->inode && entry->offset == offset && entry->length == length) {
+            page_get(entry->frame);
+            return entry->frame;
+        }
+    }
+    return 0;
+}
+
+// Cache a freshly read frame. The caller keeps its own reference.
+bool pagecache_add(fs_node_t* file, uint32_t offset, uint32_t length, uint32_t frame) {
+    if (cached_pages >= PAGECACHE_MAX_PAGES) {
+        pagecache_reclaim(PAGECACHE_TRIM);
+    }
+
+    struct cached_page* entry = (struct cached_page*)kmem_cache_alloc(cached_page_cache);
+    if (!entry) return false;
+
+    uint32_t bucket = pagecache_hash(file->inode, offset);
+    entry->inode = file->inode;
+    entry->offset = offset;
+    entry->length = length;
+    entry->frame = frame;
+    entry->next = buckets[bucket];
+    buckets[bucket] = entry;
+
+    page_get(frame);
+    pmm_get_page(frame)->flags |= PG_CACHE;
+    cached_pages++;
+    return true;
+}
+
+// Drop up to count cached pages that no process maps. Returns the
+// number of frames freed.
+uint32_t pagecache_reclaim(uint32_t count) {
+    uint32_t freed = 0;
+
+    for (uint32_t i = 0; i < PAGECACHE_BUCKETS && freed < count; i++) {
+        struct cached_page** link = &buckets[i];
+        while (*link && freed < count) {
+            struct cached_page* entry = *link;
+            if (pmm_get_page(entry->frame)->refcount > 1) {
+                link = &entry->next;
+                continue;
+            }
+
+            *link = entry->next;
+            page_put(entry->frame);
+            kmem_cache_free(cached_page_cache, entry);
+            cached_pages--;
+            freed++;
+        }
+    }
+    return freed;
+}
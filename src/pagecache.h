@@ -0,0 +1,12 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include "types.h"
+#include "vfs.h"
+
+void pagecache_init(void);
+uint32_t pagecache_find(fs_node_t* file, uint32_t offset, uint32_t length);
+bool pagecache_add(fs_node_t* file, uint32_t offset, uint32_t length, uint32_t frame);
+uint32_t pagecache_reclaim(uint32_t count);
+
+#endif
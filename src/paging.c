@@ -1,44 +1,110 @@
 #include "paging.h"
 #include "pmm.h"
 #include "idt.h"
+#include "vma.h"
+#include "process.h"
+#include "swap.h"
+
+extern void log_info(const char* msg);
 
 static uint32_t kernel_pd[1024] __attribute__((aligned(4096)));
-static uint32_t kernel_page_tables[256][1024] __attribute__((aligned(4096)));  // First 1GB
+static uint32_t low_page_table[1024] __attribute__((aligned(4096)));  // First 4MB, in 4KB pages
+static uint32_t fixmap_page_table[1024] __attribute__((aligned(4096)));  // Temporary mapping window
 static uint32_t kernel_pd_phys;
 static uint32_t current_pd_phys;
 
 extern void paging_enable(uint32_t page_directory_addr);
 
+#define IDENTITY_MAP_PDES 256   // Identity map the first 1GB
+#define CR0_WP  0x00010000
+#define CR4_PSE 0x00000010
+#define CR4_PGE 0x00000080
+#define CPUID_PSE (1 << 3)
+#define CPUID_PGE (1 << 13)
+#define FLUSH_ALL_THRESHOLD 32  // Above this many pages a full flush is cheaper than invlpg
+
+// The last directory slot maps every directory onto itself, so the
+// current address space's page tables are reachable at fixed virtual
+// addresses wherever their frames live. The slot below holds a window
+// for temporarily mapping frames of other address spaces.
+#define RECURSIVE_PDE 1023
+#define FIXMAP_PDE    1022
+#define RECURSIVE_PD  ((uint32_t*)0xFFFFF000)
+#define RECURSIVE_PT(pd_index) ((uint32_t*)(0xFFC00000 + ((pd_index) << 12)))
+#define FIXMAP_BASE   0xFF800000
+#define KMAP_SLOTS    32
+
+static inline void invlpg(uint32_t virtual_addr) {
+    __asm__ __volatile__("invlpg (%0)" : : "r"(virtual_addr) : "memory");
+}
+
+static inline uint32_t cpuid_edx(uint32_t leaf) {
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ __volatile__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(leaf));
+    return edx;
+}
+
+static inline void cr0_set(uint32_t bits) {
+    uint32_t cr0;
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ __volatile__("mov %0, %%cr0" : : "r"(cr0 | bits) : "memory");
+}
+
+static inline uint32_t cr4_read(void) {
+    uint32_t cr4;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void cr4_write(uint32_t cr4) {
+    __asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+static inline void cr4_set(uint32_t bits) {
+    cr4_write(cr4_read() | bits);
+}
+
+// Kernel mappings are global: they are the same in every address space,
+// so CR3 reloads keep their TLB entries
+static bool pge_enabled = false;
+
+// 4MB pages are available to user mappings as well
+static bool pse_enabled = false;
+
 static void page_fault_handler(struct registers* regs) {
     uint32_t fault_addr;
     __asm__ __volatile__("mov %%cr2, %0" : "=r"(fault_addr));
 
     uint32_t err = regs->err_code;
 
-    if (err & 0x1) {
-        // Protection violation
+    if (err & FAULT_RESERVED) {
+        // Reserved bit set
         goto panic;
     }
 
-    if (err & 0x8) {
-        // Reserved bit set
-        goto panic;
+    // Kernel space page tables are created in kernel_pd; adopt them lazily
+    if (fault_addr >= KERNEL_SPACE_BASE && current_pd_phys != kernel_pd_phys) {
+        uint32_t* pd = RECURSIVE_PD;
+        uint32_t pd_index = fault_addr >> 22;
+        if (!(pd[pd_index] & PAGE_PRESENT) && (kernel_pd[pd_index] & PAGE_PRESENT)) {
+            pd[pd_index] = kernel_pd[pd_index];
+            invlpg((uint32_t)RECURSIVE_PT(pd_index));
+            return;
+        }
     }
 
-    // Demand paging
-    uint32_t page_addr = fault_addr & 0xFFFFF000;
-    uint32_t flags = PAGE_PRESENT | PAGE_WRITE;
-    if (err & 0x4) flags |= PAGE_USER;
+    // User space is populated on demand, as its memory areas allow
+    if (fault_addr < KERNEL_SPACE_BASE && vma_handle_fault(fault_addr, err)) return;
 
-    uint32_t phys = pmm_alloc_page();
-    if (!phys) {
-        // OOM - halt for now
-        goto panic;
+    // A bad access ends the process that made it: any fault from user
+    // mode, or a kernel-mode fault on a user address that a syscall took
+    // on the process's behalf. Only the boot thread cannot exit.
+    process_t* proc = process_get_current();
+    if ((err & FAULT_USER) || (fault_addr < KERNEL_SPACE_BASE && proc && proc->vmas)) {
+        log_info("Segmentation fault");
+        process_exit(-1);
     }
 
-    paging_map_page(page_addr, phys, flags);
-    return;
-
 panic:
     log_info("Page Fault Panic!");
     // Print CR2
@@ -67,15 +133,44 @@ void paging_init(void) {
         kernel_pd[i] = 0;
     }
 
-    // Identity map first 1GB (kernel space)
-    for (int i = 0; i < 256; i++) {
+    uint32_t edx = cpuid_edx(1);
+    if (edx & CPUID_PGE) {
+        cr4_set(CR4_PGE);
+        pge_enabled = true;
+    }
+
+    // The first 4MB keeps 4KB pages so low memory can be given finer
+    // grained permissions later
+    for (int j = 0; j < 1024; j++) {
+        low_page_table[j] = (j * PAGE_SIZE) | PAGE_PRESENT | PAGE_WRITE | PAGE_GLOBAL;
+    }
+    kernel_pd[0] = ((uint32_t)low_page_table) | PAGE_PRESENT | PAGE_WRITE;
+
+    // Identity map the rest of the first 1GB (kernel space) with 4MB pages,
+    // or with page tables from the PMM on CPUs without PSE
+    bool pse = (edx & CPUID_PSE) != 0;
+    if (pse) {
+        cr4_set(CR4_PSE);
+        pse_enabled = true;
+    }
+    for (int i = 1; i < IDENTITY_MAP_PDES; i++) {
+        uint32_t base = i * 0x400000;
+        if (pse) {
+            kernel_pd[i] = base | PAGE_PRESENT | PAGE_WRITE | PAGE_4MB | PAGE_GLOBAL;
+            continue;
+        }
+
+        uint32_t* page_table = (uint32_t*)pmm_alloc_page();
+        if (!page_table) break;
         for (int j = 0; j < 1024; j++) {
-            uint32_t addr = (i * 1024 + j) * PAGE_SIZE;
-            kernel_page_tables[i][j] = addr | PAGE_PRESENT | PAGE_WRITE;
+            page_table[j] = (base + j * PAGE_SIZE) | PAGE_PRESENT | PAGE_WRITE | PAGE_GLOBAL;
         }
-        kernel_pd[i] = ((uint32_t)&kernel_page_tables[i]) | PAGE_PRESENT | PAGE_WRITE;
+        kernel_pd[i] = ((uint32_t)page_table) | PAGE_PRESENT | PAGE_WRITE;
     }
 
+    kernel_pd[FIXMAP_PDE] = ((uint32_t)fixmap_page_table) | PAGE_PRESENT | PAGE_WRITE;
+    kernel_pd[RECURSIVE_PDE] = ((uint32_t)kernel_pd) | PAGE_PRESENT | PAGE_WRITE;
+
     kernel_pd_phys = (uint32_t)&kernel_pd;
     current_pd_phys = kernel_pd_phys;
 
@@ -84,67 +179,280 @@ void paging_init(void) {
 
     // Enable paging
     paging_enable((uint32_t)&kernel_pd);
+
+    // Read-only user pages are read-only for the kernel too, so kernel
+    // writes to a shared page take the copy-on-write path
+    cr0_set(CR0_WP);
 }
 
-void paging_map_page(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags) {
-    uint32_t* pd = (uint32_t*)current_pd_phys;
-    uint32_t pd_index = virtual_addr >> 22;
-    uint32_t pt_index = (virtual_addr >> 12) & 0x3FF;
+// Map a frame into the temporary window. Slots are few; unmap promptly.
+void* kmap_temp(uint32_t phys) {
+    uint32_t flags = irq_save();
+    for (uint32_t slot = 0; slot < KMAP_SLOTS; slot++) {
+        if (fixmap_page_table[slot] & PAGE_PRESENT) continue;
 
-    // Check if page table exists
-    if (!(pd[pd_index] & PAGE_PRESENT)) {
-        // Allocate a new page table
-        uint32_t pt_phys = pmm_alloc_page();
-        if (!pt_phys) return;
+        fixmap_page_table[slot] = (phys & 0xFFFFF000) | PAGE_PRESENT | PAGE_WRITE;
+        irq_restore(flags);
 
-        // Clear the new page table
-        uint32_t* pt = (uint32_t*)pt_phys;
-        for (int i = 0; i < 1024; i++) {
-            pt[i] = 0;
-        }
+        uint32_t addr = FIXMAP_BASE + slot * PAGE_SIZE;
+        invlpg(addr);
+        return (void*)addr;
+    }
+    irq_restore(flags);
+    return NULL;
+}
 
-        pd[pd_index] = pt_phys | PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER);
+void kunmap_temp(void* addr) {
+    uint32_t slot = ((uint32_t)addr - FIXMAP_BASE) / PAGE_SIZE;
+    if (slot >= KMAP_SLOTS) return;
+
+    fixmap_page_table[slot] = 0;
+    invlpg((uint32_t)addr & 0xFFFFF000);
+}
+
+// Fill a fresh page table frame, through the temporary window, with
+// 1024 consecutive mappings starting at base
+static bool page_table_init(uint32_t pt_phys, uint32_t base, uint32_t flags) {
+    uint32_t* page_table = (uint32_t*)kmap_temp(pt_phys);
+    if (!page_table) return false;
+
+    for (int j = 0; j < 1024; j++) {
+        page_table[j] = (base + j * PAGE_SIZE) | flags;
+    }
+    kunmap_temp(page_table);
+    return true;
+}
+
+// Replace a 4MB mapping in the current address space with a page table
+// mapping the same frames, so single pages inside it can be changed. A
+// large user page becomes 1024 ordinary user frames, each holding the
+// reference of its own mapping.
+static bool split_large_page(uint32_t pd_index) {
+    uint32_t* pd = RECURSIVE_PD;
+    uint32_t pd_entry = pd[pd_index];
+    uint32_t pt_phys = pmm_alloc_high_page();
+    if (!pt_phys) return false;
+
+    uint32_t base = pd_entry & 0xFFC00000;
+    uint32_t flags = pd_entry & (PAGE_PRESENT | PAGE_WRITE | PAGE_USER);
+    if (!page_table_init(pt_phys, base, flags | (pd_entry & PAGE_GLOBAL))) {
+        pmm_free_page(pt_phys);
+        return false;
     }
 
-    // Get page table address
-    uint32_t* page_table = (uint32_t*)(pd[pd_index] & 0xFFFFF000);
+    pd[pd_index] = pt_phys | flags;
 
-    // Map the page
-    page_table[pt_index] = (physical_addr & 0xFFFFF000) | flags | PAGE_PRESENT;
+    if (pd_entry & PAGE_USER) {
+        for (uint32_t i = 0; i < HUGE_PAGE_PAGES; i++) {
+            struct page* page = pmm_get_page(base + i * PAGE_SIZE);
+            if (!page) continue;
+            page->flags = PG_USER;
+            page->refcount = 1;
+            page->owner_pd = current_pd_phys;
+            page->vaddr = (pd_index << 22) + i * PAGE_SIZE;
+        }
+    }
 
-    // Invalidate TLB entry
-    __asm__ __volatile__("invlpg (%0)" : : "r"(virtual_addr) : "memory");
+    // Any address inside the large page drops its TLB entry
+    invlpg(base);
+    invlpg((uint32_t)RECURSIVE_PT(pd_index));
+    return true;
 }
 
-void paging_unmap_page(uint32_t virtual_addr) {
-    uint32_t* pd = (uint32_t*)current_pd_phys;
+// Directory entry for virtual_addr in the current address space,
+// adopting a kernel space page table it has not picked up yet
+static uint32_t get_pd_entry(uint32_t virtual_addr) {
+    uint32_t* pd = RECURSIVE_PD;
     uint32_t pd_index = virtual_addr >> 22;
-    uint32_t pt_index = (virtual_addr >> 12) & 0x3FF;
+    if (!(pd[pd_index] & PAGE_PRESENT) && virtual_addr >= KERNEL_SPACE_BASE &&
+        (kernel_pd[pd_index] & PAGE_PRESENT)) {
+        pd[pd_index] = kernel_pd[pd_index];
+        invlpg((uint32_t)RECURSIVE_PT(pd_index));
+    }
+    return pd[pd_index];
+}
 
-    uint32_t pd_entry = pd[pd_index];
+// Page table covering virtual_addr in the current address space, created
+// (or split out of a 4MB mapping) if needed. Page table frames may come
+// from anywhere in physical memory; they are reached through the
+// recursive mapping.
+static uint32_t* get_page_table(uint32_t virtual_addr, uint32_t flags) {
+    uint32_t* pd = RECURSIVE_PD;
+    uint32_t pd_index = virtual_addr >> 22;
+    uint32_t pd_entry = get_pd_entry(virtual_addr);
+
+    // Check if page table exists
     if (!(pd_entry & PAGE_PRESENT)) {
+        uint32_t pt_phys = pmm_alloc_high_page();
+        if (!pt_phys) return NULL;
+
+        pd[pd_index] = pt_phys | PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER);
+        if (virtual_addr >= KERNEL_SPACE_BASE) {
+            kernel_pd[pd_index] = pd[pd_index];
+        }
+
+        uint32_t* page_table = RECURSIVE_PT(pd_index);
+        invlpg((uint32_t)page_table);
+        for (int j = 0; j < 1024; j++) {
+            page_table[j] = 0;
+        }
+    } else if ((pd_entry & PAGE_4MB) && !split_large_page(pd_index)) {
+        return NULL;
+    }
+
+    // User pages need the directory entry to allow user access as well
+    if ((flags & PAGE_USER) && !(pd[pd_index] & PAGE_USER)) {
+        pd[pd_index] |= PAGE_USER;
+    }
+
+    return RECURSIVE_PT(pd_index);
+}
+
+// Invalidate count pages from virtual_addr: page by page for short
+// ranges, one full flush above the threshold
+static void flush_range(uint32_t virtual_addr, uint32_t count) {
+    if (count > FLUSH_ALL_THRESHOLD) {
+        if (virtual_addr + count * PAGE_SIZE > KERNEL_SPACE_BASE) {
+            paging_flush_global();
+        } else {
+            paging_switch(current_pd_phys);
+        }
         return;
     }
 
-    uint32_t* page_table = (uint32_t*)(pd_entry & 0xFFFFF000);
-    page_table[pt_index] = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        invlpg(virtual_addr + i * PAGE_SIZE);
+    }
+}
 
-    // Invalidate TLB entry
-    __asm__ __volatile__("invlpg (%0)" : : "r"(virtual_addr) : "memory");
+// Map count pages at virtual_addr to frames[i], or to the physically
+// contiguous run at physical_addr when frames is NULL. Each page table
+// is walked once.
+static bool map_pages(uint32_t virtual_addr, uint32_t physical_addr, const uint32_t* frames,
+                      uint32_t count, uint32_t flags) {
+    uint32_t done = 0;
+
+    while (done < count) {
+        uint32_t addr = virtual_addr + done * PAGE_SIZE;
+        uint32_t* page_table = get_page_table(addr, flags);
+        if (!page_table) break;
+
+        // Kernel space looks the same in every address space
+        uint32_t pte_flags = flags | PAGE_PRESENT;
+        if (addr >= KERNEL_SPACE_BASE && !(flags & PAGE_USER)) {
+            pte_flags |= PAGE_GLOBAL;
+        }
+
+        for (uint32_t pt_index = (addr >> 12) & 0x3FF; pt_index < 1024 && done < count; pt_index++) {
+            uint32_t frame = frames ? frames[done] : physical_addr + done * PAGE_SIZE;
+            page_table[pt_index] = (frame & 0xFFFFF000) | pte_flags;
+
+            // Record the reverse mapping of user frames
+            if (flags & PAGE_USER) {
+                struct page* page = pmm_get_page(frame);
+                if (page && (page->flags & PG_USER)) {
+                    page->owner_pd = current_pd_phys;
+                    page->vaddr = virtual_addr + done * PAGE_SIZE;
+                }
+            }
+            done++;
+        }
+    }
+
+    flush_range(virtual_addr, done);
+    return done == count;
 }
 
-uint32_t paging_get_physical(uint32_t virtual_addr) {
-    uint32_t* pd = (uint32_t*)current_pd_phys;
+bool paging_map_page(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags) {
+    return map_pages(virtual_addr & 0xFFFFF000, physical_addr, NULL, 1, flags);
+}
+
+// Map a physically contiguous range
+bool paging_map_range(uint32_t virtual_addr, uint32_t physical_addr, uint32_t count, uint32_t flags) {
+    return map_pages(virtual_addr & 0xFFFFF000, physical_addr, NULL, count, flags);
+}
+
+// Map a virtually contiguous range onto scattered frames
+bool paging_map_frames(uint32_t virtual_addr, const uint32_t* frames, uint32_t count, uint32_t flags) {
+    return map_pages(virtual_addr & 0xFFFFF000, 0, frames, count, flags);
+}
+
+void paging_unmap_range(uint32_t virtual_addr, uint32_t count) {
+    virtual_addr &= 0xFFFFF000;
+    uint32_t done = 0;
+
+    while (done < count) {
+        uint32_t addr = virtual_addr + done * PAGE_SIZE;
+        uint32_t pd_index = addr >> 22;
+        uint32_t pt_index = (addr >> 12) & 0x3FF;
+        uint32_t left = 1024 - pt_index;
+        if (left > count - done) left = count - done;
+
+        uint32_t pd_entry = get_pd_entry(addr);
+
+        // A large user page unmapped whole goes without splitting
+        if ((pd_entry & PAGE_4MB) && (pd_entry & PAGE_USER) && left == 1024) {
+            RECURSIVE_PD[pd_index] = 0;
+            done += left;
+            continue;
+        }
+        if (pd_entry & PAGE_4MB) {
+            // The kernel's identity map is never punched through
+            if (!(pd_entry & PAGE_USER)) {
+                done += left;
+                continue;
+            }
+            if (!split_large_page(pd_index)) break;
+            pd_entry = RECURSIVE_PD[pd_index];
+        }
+
+        // Nothing is mapped under a missing page table
+        if (pd_entry & PAGE_PRESENT) {
+            uint32_t* page_table = RECURSIVE_PT(pd_index);
+            for (uint32_t i = 0; i < left; i++) {
+                page_table[pt_index + i] = 0;
+            }
+        }
+        done += left;
+    }
+
+    flush_range(virtual_addr, done);
+}
+
+// Map the 4MB-aligned run at physical_addr as one large user page in the
+// current address space. Fails without PSE or if anything is mapped in
+// the 4MB region already.
+bool paging_map_huge(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags) {
     uint32_t pd_index = virtual_addr >> 22;
+    if (!pse_enabled || virtual_addr >= KERNEL_SPACE_BASE ||
+        (RECURSIVE_PD[pd_index] & PAGE_PRESENT)) {
+        return false;
+    }
+
+    RECURSIVE_PD[pd_index] = (physical_addr & 0xFFC00000) | PAGE_PRESENT | PAGE_4MB |
+                             (flags & (PAGE_WRITE | PAGE_USER));
+    invlpg(virtual_addr & 0xFFC00000);
+    invlpg((uint32_t)RECURSIVE_PT(pd_index));
+    return true;
+}
+
+void paging_unmap_page(uint32_t virtual_addr) {
+    paging_unmap_range(virtual_addr, 1);
+}
+
+uint32_t paging_get_physical(uint32_t virtual_addr) {
     uint32_t pt_index = (virtual_addr >> 12) & 0x3FF;
     uint32_t offset = virtual_addr & 0xFFF;
 
-    uint32_t pd_entry = pd[pd_index];
+    uint32_t pd_entry = get_pd_entry(virtual_addr);
     if (!(pd_entry & PAGE_PRESENT)) {
         return 0;
     }
+    if (pd_entry & PAGE_4MB) {
+        return (pd_entry & 0xFFC00000) + (virtual_addr & 0x3FFFFF);
+    }
 
-    uint32_t* page_table = (uint32_t*)(pd_entry & 0xFFFFF000);
+    uint32_t* page_table = RECURSIVE_PT(virtual_addr >> 22);
     
     uint32_t pt_entry = page_table[pt_index];
     if (!(pt_entry & PAGE_PRESENT)) {
@@ -159,17 +467,224 @@ uint32_t paging_kernel_pd_phys(void) {
 }
 
 uint32_t paging_clone_pd(void) {
-    uint32_t new_pd_phys = pmm_alloc_page();
+    uint32_t new_pd_phys = pmm_alloc_high_page();
     if (!new_pd_phys) return 0;
 
-    uint32_t* new_pd = (uint32_t*)new_pd_phys;
-    uint32_t* kern_pd = (uint32_t*)kernel_pd_phys;
+    uint32_t* new_pd = (uint32_t*)kmap_temp(new_pd_phys);
+    if (!new_pd) {
+        pmm_free_page(new_pd_phys);
+        return 0;
+    }
+    // Share kernel space only; user page tables of whatever runs in the
+    // kernel directory stay behind
     for (int i = 0; i < 1024; i++) {
-        new_pd[i] = kern_pd[i];
+        new_pd[i] = (kernel_pd[i] & PAGE_USER) ? 0 : kernel_pd[i];
     }
+    new_pd[RECURSIVE_PDE] = new_pd_phys | PAGE_PRESENT | PAGE_WRITE;
+    kunmap_temp(new_pd);
     return new_pd_phys;
 }
 
+// Drop the reference a mapping in pd_phys holds on a user frame. A frame
+// that lives on elsewhere must not keep its reverse mapping pointing at
+// a mapping that is gone: that directory may be freed and reused.
+void paging_put_user_frame(uint32_t pd_phys, uint32_t frame) {
+    struct page* page = pmm_get_page(frame);
+    if (page && page->owner_pd == pd_phys) {
+        page->owner_pd = 0;
+    }
+    page_put(frame);
+}
+
+// Free an address space that is not current: its user page tables, a
+// reference on every user frame they map, and the directory itself
+void paging_destroy_pd(uint32_t pd_phys) {
+    uint32_t* pd = (uint32_t*)kmap_temp(pd_phys);
+    if (!pd) return;
+
+    for (uint32_t pd_index = 0; pd_index < (KERNEL_SPACE_BASE >> 22); pd_index++) {
+        uint32_t pd_entry = pd[pd_index];
+        if (!(pd_entry & PAGE_PRESENT) || !(pd_entry & PAGE_USER)) continue;
+
+        if (pd_entry & PAGE_4MB) {
+            paging_put_user_frame(pd_phys, pd_entry & 0xFFC00000);
+            pd[pd_index] = 0;
+            continue;
+        }
+
+        uint32_t* page_table = (uint32_t*)kmap_temp(pd_entry & 0xFFFFF000);
+        if (page_table) {
+            for (int j = 0; j < 1024; j++) {
+                if ((page_table[j] & PAGE_PRESENT) && (page_table[j] & PAGE_USER)) {
+                    paging_put_user_frame(pd_phys, page_table[j] & 0xFFFFF000);
+                } else if (page_table[j] & PAGE_SWAPPED) {
+                    swap_free(page_table[j]);
+                }
+            }
+            kunmap_temp(page_table);
+        }
+        pmm_free_page(pd_entry & 0xFFFFF000);
+        pd[pd_index] = 0;
+    }
+    kunmap_temp(pd);
+    pmm_free_page(pd_phys);
+}
+
+// Address space for a forked child of the current one. User page tables
+// are copied, but the frames they map are shared: writable pages turn
+// read-only on both sides and the first write to one faults in a
+// private copy. The cost is one page table per 4MB of user space in
+// use, whatever the resident size. Large pages are split first, since
+// their protection changes.
+uint32_t paging_fork_pd(void) {
+    uint32_t child_pd_phys = paging_clone_pd();
+    if (!child_pd_phys) return 0;
+
+    uint32_t* child_pd = (uint32_t*)kmap_temp(child_pd_phys);
+    if (!child_pd) {
+        pmm_free_page(child_pd_phys);
+        return 0;
+    }
+
+    bool ok = true;
+    for (uint32_t pd_index = 0; pd_index < (KERNEL_SPACE_BASE >> 22) && ok; pd_index++) {
+        uint32_t pd_entry = RECURSIVE_PD[pd_index];
+        if (!(pd_entry & PAGE_PRESENT) || !(pd_entry & PAGE_USER)) continue;
+
+        if (pd_entry & PAGE_4MB) {
+            if (!split_large_page(pd_index)) {
+                ok = false;
+                break;
+            }
+            pd_entry = RECURSIVE_PD[pd_index];
+        }
+
+        uint32_t pt_phys = pmm_alloc_high_page();
+        uint32_t* child_pt = pt_phys ? (uint32_t*)kmap_temp(pt_phys) : NULL;
+        if (!child_pt) {
+            if (pt_phys) pmm_free_page(pt_phys);
+            ok = false;
+            break;
+        }
+
+        uint32_t* page_table = RECURSIVE_PT(pd_index);
+        for (int j = 0; j < 1024; j++) {
+            uint32_t pte = page_table[j];
+            if ((pte & PAGE_PRESENT) && (pte & PAGE_USER)) {
+                pte &= ~PAGE_WRITE;
+                page_table[j] = pte;
+                page_get(pte & 0xFFFFF000);
+            } else if (pte & PAGE_SWAPPED) {
+                swap_dup(pte);
+            }
+            child_pt[j] = pte;
+        }
+        kunmap_temp(child_pt);
+        child_pd[pd_index] = pt_phys | (pd_entry & 0xFFF);
+    }
+    kunmap_temp(child_pd);
+
+    // The parent's write permissions changed
+    paging_switch(current_pd_phys);
+
+    if (!ok) {
+        paging_destroy_pd(child_pd_phys);
+        return 0;
+    }
+    return child_pd_phys;
+}
+
+// Read the PTE for virtual_addr in any address space. Returns 0 if there
+// is no page table or the address sits in a 4MB mapping.
+uint32_t paging_get_pte(uint32_t pd_phys, uint32_t virtual_addr) {
+    uint32_t pd_index = virtual_addr >> 22;
+    uint32_t pt_index = (virtual_addr >> 12) & 0x3FF;
+
+    if (pd_phys == current_pd_phys) {
+        uint32_t pd_entry = RECURSIVE_PD[pd_index];
+        if (!(pd_entry & PAGE_PRESENT) || (pd_entry & PAGE_4MB)) return 0;
+        return RECURSIVE_PT(pd_index)[pt_index];
+    }
+
+    uint32_t* pd = (uint32_t*)kmap_temp(pd_phys);
+    if (!pd) return 0;
+    uint32_t pd_entry = pd[pd_index];
+    kunmap_temp(pd);
+    if (!(pd_entry & PAGE_PRESENT) || (pd_entry & PAGE_4MB)) return 0;
+
+    uint32_t* page_table = (uint32_t*)kmap_temp(pd_entry & 0xFFFFF000);
+    if (!page_table) return 0;
+    uint32_t pte = page_table[pt_index];
+    kunmap_temp(page_table);
+    return pte;
+}
+
+// Directory entry covering virtual_addr in any address space
+uint32_t paging_get_pde(uint32_t pd_phys, uint32_t virtual_addr) {
+    uint32_t pd_index = virtual_addr >> 22;
+    if (pd_phys == current_pd_phys) {
+        return RECURSIVE_PD[pd_index];
+    }
+
+    uint32_t* pd = (uint32_t*)kmap_temp(pd_phys);
+    if (!pd) return 0;
+    uint32_t pd_entry = pd[pd_index];
+    kunmap_temp(pd);
+    return pd_entry;
+}
+
+// Replace the PTE for virtual_addr in any address space that has a page
+// table there
+void paging_set_pte(uint32_t pd_phys, uint32_t virtual_addr, uint32_t pte) {
+    uint32_t pd_index = virtual_addr >> 22;
+    uint32_t pt_index = (virtual_addr >> 12) & 0x3FF;
+
+    if (pd_phys == current_pd_phys) {
+        uint32_t pd_entry = RECURSIVE_PD[pd_index];
+        if (!(pd_entry & PAGE_PRESENT) || (pd_entry & PAGE_4MB)) return;
+
+        RECURSIVE_PT(pd_index)[pt_index] = pte;
+        invlpg(virtual_addr);
+        return;
+    }
+
+    uint32_t* pd = (uint32_t*)kmap_temp(pd_phys);
+    if (!pd) return;
+    uint32_t pd_entry = pd[pd_index];
+    kunmap_temp(pd);
+    if (!(pd_entry & PAGE_PRESENT) || (pd_entry & PAGE_4MB)) return;
+
+    uint32_t* page_table = (uint32_t*)kmap_temp(pd_entry & 0xFFFFF000);
+    if (!page_table) return;
+    page_table[pt_index] = pte;
+    kunmap_temp(page_table);
+}
+
+// Point an existing mapping at a new frame, keeping its flags
+void paging_migrate_page(uint32_t pd_phys, uint32_t virtual_addr, uint32_t new_phys) {
+    uint32_t pte = paging_get_pte(pd_phys, virtual_addr);
+    if (!(pte & PAGE_PRESENT)) return;
+
+    paging_set_pte(pd_phys, virtual_addr, (new_phys & 0xFFFFF000) | (pte & 0xFFF));
+}
+
+// Flush every TLB entry, global kernel mappings included. invlpg already
+// drops global entries for single pages; this is for bulk changes to
+// kernel mappings.
+void paging_flush_global(void) {
+    if (!pge_enabled) {
+        paging_switch(current_pd_phys);
+        return;
+    }
+
+    // Toggling CR4.PGE invalidates the whole TLB
+    uint32_t flags = irq_save();
+    uint32_t cr4 = cr4_read();
+    cr4_write(cr4 & ~CR4_PGE);
+    cr4_write(cr4);
+    irq_restore(flags);
+}
+
 void paging_switch(uint32_t pd_phys) {
     current_pd_phys = pd_phys;
     __asm__ __volatile__("mov %0, %%cr3" : : "r"(pd_phys) : "memory");
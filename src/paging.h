@@ -7,17 +7,37 @@
 #define PAGE_PRESENT   0x001
 #define PAGE_WRITE     0x002
 #define PAGE_USER      0x004
+#define PAGE_ACCESSED  0x020
 #define PAGE_4MB       0x080
+#define PAGE_GLOBAL    0x100
+#define PAGE_SWAPPED   0x200  // Not-present entry holding a swap slot in bits 12-31
+
+// Page tables above this address are shared by every address space
+#define KERNEL_SPACE_BASE 0xC0000000
 
 typedef uint32_t* page_directory_t;
 typedef uint32_t* page_table_t;
 
 void paging_init(void);
-void paging_map_page(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags);
+bool paging_map_page(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags);
 void paging_unmap_page(uint32_t virtual_addr);
+bool paging_map_range(uint32_t virtual_addr, uint32_t physical_addr, uint32_t count, uint32_t flags);
+bool paging_map_frames(uint32_t virtual_addr, const uint32_t* frames, uint32_t count, uint32_t flags);
+void paging_unmap_range(uint32_t virtual_addr, uint32_t count);
+bool paging_map_huge(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags);
 uint32_t paging_get_physical(uint32_t virtual_addr);
 uint32_t paging_kernel_pd_phys(void);
 uint32_t paging_clone_pd(void);
+uint32_t paging_fork_pd(void);
+void paging_destroy_pd(uint32_t pd_phys);
+void paging_put_user_frame(uint32_t pd_phys, uint32_t frame);
 void paging_switch(uint32_t pd_phys);
+void paging_flush_global(void);
+void* kmap_temp(uint32_t phys);
+void kunmap_temp(void* addr);
+uint32_t paging_get_pde(uint32_t pd_phys, uint32_t virtual_addr);
+uint32_t paging_get_pte(uint32_t pd_phys, uint32_t virtual_addr);
+void paging_set_pte(uint32_t pd_phys, uint32_t virtual_addr, uint32_t pte);
+void paging_migrate_page(uint32_t pd_phys, uint32_t virtual_addr, uint32_t new_phys);
 
 #endif
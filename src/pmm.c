@@ -1,11 +1,56 @@
 #include "pmm.h"
+#include "paging.h"
+#include "pagecache.h"
 
-#define BITMAP_SIZE 32768  // Supports up to 512MB of RAM (32768 * 32 * 4KB)
+// Buddy allocator: free blocks of 2^order pages, orders 0..PMM_MAX_ORDER (4MB)
+#define PMM_MAX_ORDER 10
+#define PFN_NONE 0xFFFFFFFF
+#define ORDER_NONE 0xFF
+#define PMM_MAX_RANGES 32
 
-static uint32_t bitmap[BITMAP_SIZE];
+// Physical memory zones. Boundaries are multiples of the largest buddy
+// block, so a buddy pair never straddles two zones.
+#define ZONE_DMA     0  // Below 16MB, reachable by ISA and IDE bus-master DMA
+#define ZONE_NORMAL  1  // Up to 1GB, identity mapped for the kernel
+#define ZONE_HIGHMEM 2  // Above the identity map, for user frames only
+#define ZONE_COUNT   3
+
+struct zone {
+    uint32_t free_area[PMM_MAX_ORDER + 1];
+    uint32_t free_mask;   // Bit n set when free_area[n] is non-empty
+    uint32_t free_pages;
+};
+
+// Zone fallback orders: the kernel needs directly addressable frames and
+// keeps DMA memory as a last resort; user frames prefer high memory
+static const uint8_t kernel_zones[] = { ZONE_NORMAL, ZONE_DMA };
+static const uint8_t user_zones[] = { ZONE_HIGHMEM, ZONE_NORMAL, ZONE_DMA };
+
+// Cached file pages no process maps are dropped when an allocation fails
+#define PMM_RECLAIM_PAGES 8
+
+// Frames cleared ahead of time by the idle thread
+#define ZERO_POOL_SIZE 64
+
+// The bitmap and page frame database are sized from the memory map and carved
+// from the memory right after the kernel image at boot
+static uint32_t* bitmap = NULL;
+static uint32_t bitmap_words = 0;
 static uint32_t total_pages = 0;
 static uint32_t used_pages = 0;
 
+static struct page* page_db = NULL;
+static struct zone zones[ZONE_COUNT];
+static uint32_t max_pfn = 0;
+static uint32_t boot_alloc_ptr = 0;
+
+static uint32_t zero_pool[ZERO_POOL_SIZE];
+static uint32_t zero_pool_count = 0;
+
+static uint32_t compact_attempts = 0;
+static uint32_t compact_successes = 0;
+static uint32_t compact_pages_moved = 0;
+
 // External symbols from linker
 extern uint32_t _end;
 
@@ -21,10 +66,278 @@ static inline bool bitmap_test(uint32_t page) {
     return bitmap[page / 32] & (1 << (page % 32));
 }
 
+// Mark [start, start + count) used, a whole word at a time where possible
+static void bitmap_set_range(uint32_t start, uint32_t count) {
+    uint32_t end = start + count;
+    while (start < end && (start % 32)) bitmap_set(start++);
+    while (start + 32 <= end) {
+        bitmap[start / 32] = 0xFFFFFFFF;
+        start += 32;
+    }
+    while (start < end) bitmap_set(start++);
+}
+
+static void bitmap_clear_range(uint32_t start, uint32_t count) {
+    uint32_t end = start + count;
+    while (start < end && (start % 32)) bitmap_clear(start++);
+    while (start + 32 <= end) {
+        bitmap[start / 32] = 0;
+        start += 32;
+    }
+    while (start < end) bitmap_clear(start++);
+}
+
+static inline uint32_t floor_log2(uint32_t n) {
+    return 31 - __builtin_clz(n);
+}
+
+static inline uint32_t order_for(uint32_t n) {
+    uint32_t order = floor_log2(n);
+    if ((1u << order) < n) order++;
+    return order;
+}
+
+// First frame of each zone
+static const uint32_t zone_start_pfn[ZONE_COUNT] = {
+    0, PMM_DMA_LIMIT / PAGE_SIZE, PMM_DIRECT_MAP_LIMIT / PAGE_SIZE
+};
+
+static inline uint32_t zone_of(uint32_t pfn) {
+    if (pfn < PMM_DMA_LIMIT / PAGE_SIZE) return ZONE_DMA;
+    if (pfn < PMM_DIRECT_MAP_LIMIT / PAGE_SIZE) return ZONE_NORMAL;
+    return ZONE_HIGHMEM;
+}
+
+// Per-frame state for a block leaving or entering the free lists
+static void pages_mark_allocated(uint32_t pfn, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        page_db[pfn + i].refcount = 1;
+        page_db[pfn + i].flags = PG_KERNEL;
+        page_db[pfn + i].owner_pd = 0;
+    }
+}
+
+static void pages_mark_free(uint32_t pfn, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        page_db[pfn + i].refcount = 0;
+        page_db[pfn + i].flags = PG_FREE;
+    }
+}
+
+static void free_list_push(uint32_t pfn, uint32_t order) {
+    struct zone* zone = &zones[zone_of(pfn)];
+    struct page* p = &page_db[pfn];
+    p->order = order;
+    p->prev = PFN_NONE;
+    p->next = zone->free_area[order];
+    if (p->next != PFN_NONE) {
+        page_db[p->next].prev = pfn;
+    }
+    zone->free_area[order] = pfn;
+    zone->free_mask |= 1 << order;
+    zone->free_pages += 1 << order;
+}
+
+static void free_list_remove(uint32_t pfn, uint32_t order) {
+    struct zone* zone = &zones[zone_of(pfn)];
+    struct page* p = &page_db[pfn];
+    if (p->prev != PFN_NONE) {
+        page_db[p->prev].next = p->next;
+    } else {
+        zone->free_area[order] = p->next;
+        if (p->next == PFN_NONE) {
+            zone->free_mask &= ~(1 << order);
+        }
+    }
+    if (p->next != PFN_NONE) {
+        page_db[p->next].prev = p->prev;
+    }
+    p->order = ORDER_NONE;
+    zone->free_pages -= 1 << order;
+}
+
+// Put a run of free pages on the free lists as maximal aligned blocks.
+// Blocks are carved from the top of the run so the lowest block ends up at
+// the head of its list.
+static void buddy_add_range(uint32_t start, uint32_t end) {
+    while (end > start) {
+        uint32_t order = floor_log2(end - start);
+        if (order > PMM_MAX_ORDER) order = PMM_MAX_ORDER;
+        while (end & ((1 << order) - 1)) order--;
+        end -= 1 << order;
+        pages_mark_free(end, 1 << order);
+        free_list_push(end, order);
+    }
+}
+
+// Return an allocated block to the free lists, merging with free buddies
+static void buddy_free_block(uint32_t pfn, uint32_t order) {
+    bitmap_clear_range(pfn, 1 << order);
+    pages_mark_free(pfn, 1 << order);
+    used_pages -= 1 << order;
+
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = pfn ^ (1 << order);
+        if (buddy >= max_pfn || page_db[buddy].order != order) {
+            break;
+        }
+        free_list_remove(buddy, order);
+        pfn &= ~(1 << order);
+        order++;
+    }
+    free_list_push(pfn, order);
+}
+
+// Take free block pfn of order o off its list and split it down to order,
+// keeping the lower half and freeing the upper halves
+static void buddy_take_block(uint32_t pfn, uint32_t o, uint32_t order) {
+    free_list_remove(pfn, o);
+    while (o > order) {
+        o--;
+        free_list_push(pfn + (1 << o), o);
+    }
+
+    bitmap_set_range(pfn, 1 << order);
+    pages_mark_allocated(pfn, 1 << order);
+    used_pages += 1 << order;
+}
+
+static uint32_t buddy_alloc_block(uint32_t zone_id, uint32_t order) {
+    struct zone* zone = &zones[zone_id];
+
+    // Smallest non-empty order that can satisfy the request
+    uint32_t avail = zone->free_mask >> order;
+    if (!avail) return PFN_NONE;
+    uint32_t o = order + __builtin_ctz(avail);
+
+    uint32_t pfn = zone->free_area[o];
+    buddy_take_block(pfn, o, order);
+    return pfn;
+}
+
+// Allocator state is shared with interrupt handlers and the idle thread,
+// so every entry into the free lists runs with interrupts off
+static uint32_t buddy_alloc_zones(const uint8_t* list, uint32_t count, uint32_t order) {
+    uint32_t flags = irq_save();
+    uint32_t pfn = PFN_NONE;
+    for (uint32_t i = 0; i < count && pfn == PFN_NONE; i++) {
+        pfn = buddy_alloc_block(list[i], order);
+    }
+    irq_restore(flags);
+    return pfn;
+}
+
+// Requests above the maximum order need several adjacent max-order blocks
+static uint32_t buddy_alloc_large(uint32_t zone_id, uint32_t n) {
+    uint32_t blocks = (n + (1 << PMM_MAX_ORDER) - 1) >> PMM_MAX_ORDER;
+    struct zone* zone = &zones[zone_id];
+    uint32_t flags = irq_save();
+
+    for (uint32_t pfn = zone->free_area[PMM_MAX_ORDER]; pfn != PFN_NONE; pfn = page_db[pfn].next) {
+        uint32_t k;
+        for (k = 1; k < blocks; k++) {
+            uint32_t next = pfn + (k << PMM_MAX_ORDER);
+            if (next >= max_pfn || zone_of(next) != zone_id ||
+                page_db[next].order != PMM_MAX_ORDER) break;
+        }
+        if (k < blocks) continue;
+
+        for (k = 0; k < blocks; k++) {
+            buddy_take_block(pfn + (k << PMM_MAX_ORDER), PMM_MAX_ORDER, PMM_MAX_ORDER);
+        }
+        irq_restore(flags);
+        return pfn;
+    }
+    irq_restore(flags);
+    return PFN_NONE;
+}
+
+// Free every allocated page in [pfn, pfn + n) as aligned buddy blocks
+static void buddy_free_range(uint32_t pfn, uint32_t n) {
+    uint32_t end = pfn + n;
+    if (end > max_pfn) end = max_pfn;
+
+    uint32_t flags = irq_save();
+    while (pfn < end) {
+        if (!bitmap_test(pfn)) {
+            pfn++;
+            continue;
+        }
+
+        uint32_t run_end = pfn;
+        while (run_end < end && bitmap_test(run_end)) run_end++;
+
+        while (pfn < run_end) {
+            uint32_t order = floor_log2(run_end - pfn);
+            if (order > PMM_MAX_ORDER) order = PMM_MAX_ORDER;
+            if (pfn && (uint32_t)__builtin_ctz(pfn) < order) order = __builtin_ctz(pfn);
+            buddy_free_block(pfn, order);
+            pfn += 1 << order;
+        }
+    }
+    irq_restore(flags);
+}
+
+// Build the free lists from the bitmap, highest pages first, skipping whole
+// words that are entirely used or entirely free
+static void buddy_build_free_lists(void) {
+    uint32_t pfn = max_pfn;
+    while (pfn > 0) {
+        while (pfn > 0) {
+            if (!(pfn % 32) && bitmap[pfn / 32 - 1] == 0xFFFFFFFF) {
+                pfn -= 32;
+            } else if (bitmap_test(pfn - 1)) {
+                pfn--;
+            } else {
+                break;
+            }
+        }
+
+        uint32_t end = pfn;
+        while (pfn > 0) {
+            if (!(pfn % 32) && bitmap[pfn / 32 - 1] == 0) {
+                pfn -= 32;
+            } else if (!bitmap_test(pfn - 1)) {
+                pfn--;
+            } else {
+                break;
+            }
+        }
+
+        if (end > pfn) {
+            buddy_add_range(pfn, end);
+        }
+    }
+}
+
+static void* pmm_boot_alloc(uint32_t size) {
+    void* ptr = (void*)boot_alloc_ptr;
+    boot_alloc_ptr = (boot_alloc_ptr + size + 3) & ~3;
+    return ptr;
+}
+
+// Release the usable part of [start_page, end_page) to the bitmap
+static void pmm_add_free_range(uint32_t start_page, uint32_t end_page, uint32_t first_free) {
+    if (start_page < first_free) start_page = first_free;
+    if (end_page > max_pfn) end_page = max_pfn;
+    if (start_page >= end_page) return;
+
+    bitmap_clear_range(start_page, end_page - start_page);
+    total_pages += end_page - start_page;
+}
+
 void pmm_init(struct multiboot_info* mboot) {
-    // Mark all memory as used initially
-    for (uint32_t i = 0; i < BITMAP_SIZE; i++) {
-        bitmap[i] = 0xFFFFFFFF;
+    // Usable ranges are copied out of the memory map first, since the
+    // multiboot structures may live where the PMM metadata is placed
+    struct { uint32_t start, end; } ranges[PMM_MAX_RANGES];
+    uint32_t range_count = 0;
+
+    for (uint32_t z = 0; z < ZONE_COUNT; z++) {
+        for (uint32_t o = 0; o <= PMM_MAX_ORDER; o++) {
+            zones[z].free_area[o] = PFN_NONE;
+        }
+        zones[z].free_mask = 0;
+        zones[z].free_pages = 0;
     }
 
     // Get kernel end address (aligned to page boundary)
@@ -35,71 +348,91 @@ void pmm_init(struct multiboot_info* mboot) {
         struct multiboot_mmap_entry* mmap = (struct multiboot_mmap_entry*)mboot->mmap_addr;
         uint32_t mmap_end = mboot->mmap_addr + mboot->mmap_length;
 
-        while ((uint32_t)mmap < mmap_end) {
-            // Type 1 = available memory
-            if (mmap->type == 1) {
-                uint64_t addr = mmap->addr;
-                uint64_t len = mmap->len;
-
-                // Only use memory below 4GB for now (32-bit)
-                if (addr < 0x100000000ULL) {
-                    if (addr + len > 0x100000000ULL) {
-                        len = 0x100000000ULL - addr;
-                    }
-
-                    uint32_t start_page = (uint32_t)((addr + PAGE_SIZE - 1) / PAGE_SIZE);
-                    uint32_t end_page = (uint32_t)((addr + len) / PAGE_SIZE);
-
-                    for (uint32_t page = start_page; page < end_page; page++) {
-                        // Don't free memory below 1MB or kernel memory
-                        uint32_t page_addr = page * PAGE_SIZE;
-                        if (page_addr >= 0x100000 && page_addr >= kernel_end) {
-                            bitmap_clear(page);
-                            total_pages++;
-                        }
-                    }
-                }
-            }
+        while ((uint32_t)mmap < mmap_end && range_count < PMM_MAX_RANGES) {
+            // Type 1 = available memory; only memory below 4GB is used (32-bit)
+            if (mmap->type == 1 && mmap->addr < 0x100000000ULL) {
+                uint64_t top = mmap->addr + mmap->len;
+                if (top > 0x100000000ULL) top = 0x100000000ULL;
 
+                ranges[range_count].start = (uint32_t)((mmap->addr + PAGE_SIZE - 1) / PAGE_SIZE);
+                ranges[range_count].end = (uint32_t)(top / PAGE_SIZE);
+                if (ranges[range_count].end > max_pfn) max_pfn = ranges[range_count].end;
+                range_count++;
+            }
             mmap = (struct multiboot_mmap_entry*)((uint32_t)mmap + mmap->size + sizeof(mmap->size));
         }
     } else {
-        // Fallback: use mem_upper from multiboot
-        uint32_t mem_size = (mboot->mem_upper + 1024) * 1024;  // Convert to bytes
-        uint32_t start_page = kernel_end / PAGE_SIZE;
-        uint32_t end_page = mem_size / PAGE_SIZE;
+        // Fallback: use mem_upper from multiboot (KB above 1MB)
+        max_pfn = (mboot->mem_upper + 1024) / 4;
+        ranges[0].start = 0;
+        ranges[0].end = max_pfn;
+        range_count = 1;
+    }
 
-        for (uint32_t page = start_page; page < end_page && page < BITMAP_SIZE * 32; page++) {
-            bitmap_clear(page);
-            total_pages++;
-        }
+    // Carve the bitmap and page frame database right after the kernel image
+    boot_alloc_ptr = kernel_end;
+    bitmap_words = (max_pfn + 31) / 32;
+    bitmap = (uint32_t*)pmm_boot_alloc(bitmap_words * sizeof(uint32_t));
+    page_db = (struct page*)pmm_boot_alloc(max_pfn * sizeof(struct page));
+    uint32_t alloc_start = (boot_alloc_ptr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    // Mark all memory as used initially
+    for (uint32_t i = 0; i < bitmap_words; i++) {
+        bitmap[i] = 0xFFFFFFFF;
+    }
+    for (uint32_t i = 0; i < max_pfn; i++) {
+        page_db[i].refcount = 0;
+        page_db[i].flags = 0;
+        page_db[i].order = ORDER_NONE;
     }
 
+    // Don't free memory below 1MB, the kernel or the PMM's own metadata
+    uint32_t first_free = alloc_start / PAGE_SIZE;
+    if (first_free < 0x100000 / PAGE_SIZE) first_free = 0x100000 / PAGE_SIZE;
+
+    for (uint32_t i = 0; i < range_count; i++) {
+        pmm_add_free_range(ranges[i].start, ranges[i].end, first_free);
+    }
+
+    buddy_build_free_lists();
     used_pages = 0;
 }
 
+static uint32_t zero_pool_pop(void) {
+    uint32_t flags = irq_save();
+    uint32_t addr = zero_pool_count ? zero_pool[--zero_pool_count] : 0;
+    irq_restore(flags);
+    return addr;
+}
+
+static inline void page_clear(uint32_t addr) {
+    uint32_t count = PAGE_SIZE / 4;
+    __asm__ __volatile__("rep stosl"
+                         : "+D"(addr), "+c"(count)
+                         : "a"(0)
+                         : "memory");
+}
+
+// Give memory held only by the page cache back to the buddy allocator.
+// Returns true if anything was freed, so the caller can retry.
+static bool pmm_reclaim(void) {
+    return pagecache_reclaim(PMM_RECLAIM_PAGES) != 0;
+}
+
 uint32_t pmm_alloc_page(void) {
-    for (uint32_t i = 0; i < BITMAP_SIZE; i++) {
-        if (bitmap[i] != 0xFFFFFFFF) {
-            for (uint32_t j = 0; j < 32; j++) {
-                if (!(bitmap[i] & (1 << j))) {
-                    uint32_t page = i * 32 + j;
-                    bitmap_set(page);
-                    used_pages++;
-                    return page * PAGE_SIZE;
-                }
-            }
-        }
+    uint32_t pfn = buddy_alloc_zones(kernel_zones, sizeof(kernel_zones), 0);
+    if (pfn == PFN_NONE && pmm_reclaim()) {
+        pfn = buddy_alloc_zones(kernel_zones, sizeof(kernel_zones), 0);
     }
-    return 0;  // Out of memory
+    if (pfn == PFN_NONE) {
+        // Fall back to frames parked in the zero pool
+        return zero_pool_pop();
+    }
+    return pfn * PAGE_SIZE;
 }
 
 void pmm_free_page(uint32_t addr) {
-    uint32_t page = addr / PAGE_SIZE;
-    if (bitmap_test(page)) {
-        bitmap_clear(page);
-        used_pages--;
-    }
+    buddy_free_range(addr / PAGE_SIZE, 1);
 }
 
 uint32_t pmm_get_free_pages(void) {
@@ -110,36 +443,381 @@ uint32_t pmm_get_total_pages(void) {
     return total_pages;
 }
 
+static inline void page_copy(uint32_t dst, uint32_t src) {
+    uint32_t count = PAGE_SIZE / 4;
+    __asm__ __volatile__("rep movsl"
+                         : "+D"(dst), "+S"(src), "+c"(count)
+                         : : "memory");
+}
+
+// Compaction: migrate movable user frames out of one aligned block of the
+// kernel zones so a contiguous request of that order can be satisfied.
+
+// A frame can move when exactly one user mapping owns it and the reverse
+// map still points at that mapping
+static bool page_movable(uint32_t pfn) {
+    struct page* page = &page_db[pfn];
+    if (!(page->flags & PG_USER) || (page->flags & PG_CACHE) || page->refcount != 1 || !page->owner_pd) {
+        return false;
+    }
+    uint32_t pte = paging_get_pte(page->owner_pd, page->vaddr);
+    return (pte & PAGE_PRESENT) && (pte & 0xFFFFF000) == pfn * PAGE_SIZE;
+}
+
+// Frames to migrate before the block is free, or PFN_NONE if it holds
+// anything that cannot move
+static uint32_t compact_block_cost(uint32_t base, uint32_t order) {
+    uint32_t cost = 0;
+    for (uint32_t pfn = base; pfn < base + (1 << order); pfn++) {
+        if (!bitmap_test(pfn)) continue;
+        if (!page_movable(pfn)) return PFN_NONE;
+        cost++;
+    }
+    return cost;
+}
+
+static void compact_block(uint32_t base, uint32_t order) {
+    uint32_t end = base + (1 << order);
+
+    // Take the free blocks inside the target off the free lists so they are
+    // not picked as migration destinations
+    for (uint32_t pfn = base; pfn < end; ) {
+        uint32_t o = page_db[pfn].order;
+        if (o != ORDER_NONE) {
+            buddy_take_block(pfn, o, o);
+            pfn += 1 << o;
+        } else {
+            pfn++;
+        }
+    }
+
+    for (uint32_t pfn = base; pfn < end; pfn++) {
+        struct page* src = &page_db[pfn];
+        if (!(src->flags & PG_USER)) continue;
+
+        uint32_t dst_pfn = buddy_alloc_zones(kernel_zones, sizeof(kernel_zones), 0);
+        struct page* dst = &page_db[dst_pfn];
+        page_copy(dst_pfn * PAGE_SIZE, pfn * PAGE_SIZE);
+        dst->flags = src->flags;
+        dst->owner_pd = src->owner_pd;
+        dst->vaddr = src->vaddr;
+        paging_migrate_page(src->owner_pd, src->vaddr, dst_pfn * PAGE_SIZE);
+
+        src->flags = PG_KERNEL;
+        src->owner_pd = 0;
+        compact_pages_moved++;
+    }
+
+    // Every frame in the block now belongs to the compactor; freeing it
+    // merges the whole block back into one free block of the target order
+    buddy_free_range(base, 1 << order);
+}
+
+// Try to make a free block of the given order by migrating user frames.
+// Picks the aligned block needing the fewest moves.
+bool pmm_compact(uint32_t order) {
+    if (order == 0 || order > PMM_MAX_ORDER) return false;
+
+    uint32_t flags = irq_save();
+    compact_attempts++;
+
+    uint32_t free_pages = 0;
+    for (uint32_t i = 0; i < sizeof(kernel_zones); i++) {
+        free_pages += zones[kernel_zones[i]].free_pages;
+    }
+
+    uint32_t best = PFN_NONE;
+    uint32_t best_cost = PFN_NONE;
+    uint32_t end_pfn = PMM_DIRECT_MAP_LIMIT / PAGE_SIZE;
+    if (end_pfn > max_pfn) end_pfn = max_pfn;
+
+    for (uint32_t base = 0; base + (1 << order) <= end_pfn && best_cost > 1; base += 1 << order) {
+        uint32_t cost = compact_block_cost(base, order);
+        if (cost == PFN_NONE || cost >= best_cost) continue;
+
+        // Destinations must come from free frames outside the block
+        uint32_t free_inside = (1 << order) - cost;
+        if (free_pages - free_inside < cost) continue;
+
+        best = base;
+        best_cost = cost;
+    }
+
+    if (best == PFN_NONE) {
+        irq_restore(flags);
+        return false;
+    }
+
+    compact_block(best, order);
+    compact_successes++;
+    irq_restore(flags);
+    return true;
+}
+
+void pmm_get_compact_stats(uint32_t* attempts, uint32_t* successes, uint32_t* pages_moved) {
+    if (attempts) *attempts = compact_attempts;
+    if (successes) *successes = compact_successes;
+    if (pages_moved) *pages_moved = compact_pages_moved;
+}
+
 uint32_t pmm_alloc_pages(uint32_t n) {
     if (n == 0) return 0;
-    uint32_t total_avail = BITMAP_SIZE * 32;
-    for (uint32_t start = 0; start <= total_avail - n; ++start) {
-        bool can_alloc = true;
-        for (uint32_t k = 0; k < n; ++k) {
-            if (bitmap_test(start + k)) {
-                can_alloc = false;
-                break;
-            }
+
+    uint32_t pfn = PFN_NONE;
+    if (n > (1u << PMM_MAX_ORDER)) {
+        for (uint32_t i = 0; i < sizeof(kernel_zones) && pfn == PFN_NONE; i++) {
+            pfn = buddy_alloc_large(kernel_zones[i], n);
         }
-        if (can_alloc) {
-            for (uint32_t k = 0; k < n; ++k) {
-                bitmap_set(start + k);
+        if (pfn == PFN_NONE) return 0;
+        buddy_free_range(pfn + n, (((n + (1 << PMM_MAX_ORDER) - 1) >> PMM_MAX_ORDER) << PMM_MAX_ORDER) - n);
+        return pfn * PAGE_SIZE;
+    }
+
+    uint32_t order = order_for(n);
+    pfn = buddy_alloc_zones(kernel_zones, sizeof(kernel_zones), order);
+    if (pfn == PFN_NONE && pmm_reclaim()) {
+        pfn = buddy_alloc_zones(kernel_zones, sizeof(kernel_zones), order);
+    }
+    if (pfn == PFN_NONE && pmm_compact(order)) {
+        pfn = buddy_alloc_zones(kernel_zones, sizeof(kernel_zones), order);
+    }
+    if (pfn == PFN_NONE) return 0;
+
+    // Give back the unused tail of the power-of-two block
+    if ((1u << order) > n) {
+        buddy_free_range(pfn + n, (1 << order) - n);
+    }
+    return pfn * PAGE_SIZE;
+}
+
+// Allocate n contiguous, directly addressable pages that end at or below
+// max_addr and do not cross a multiple of boundary (a power of two, or 0
+// for no limit). Buddy blocks are naturally aligned, so any block no
+// larger than the boundary cannot cross one.
+uint32_t pmm_alloc_pages_constrained(uint32_t n, uint32_t max_addr, uint32_t boundary) {
+    if (n == 0 || n > (1u << PMM_MAX_ORDER)) return 0;
+    if (boundary && n * PAGE_SIZE > boundary) return 0;
+
+    uint32_t order = order_for(n);
+    uint32_t limit_pfn = max_addr / PAGE_SIZE;
+
+    uint32_t flags = irq_save();
+    for (uint32_t i = 0; i < sizeof(kernel_zones); i++) {
+        // A zone starting at or above the limit has nothing low enough,
+        // so DMA requests go straight to the DMA zone
+        if (zone_start_pfn[kernel_zones[i]] >= limit_pfn) continue;
+        struct zone* zone = &zones[kernel_zones[i]];
+
+        for (uint32_t o = order; o <= PMM_MAX_ORDER; o++) {
+            if (!(zone->free_mask & (1 << o))) continue;
+
+            for (uint32_t pfn = zone->free_area[o]; pfn != PFN_NONE; pfn = page_db[pfn].next) {
+                if (pfn + (1 << order) > limit_pfn) continue;
+
+                buddy_take_block(pfn, o, order);
+                if ((1u << order) > n) {
+                    buddy_free_range(pfn + n, (1 << order) - n);
+                }
+                irq_restore(flags);
+                return pfn * PAGE_SIZE;
             }
-            used_pages += n;
-            return start * PAGE_SIZE;
         }
     }
+    irq_restore(flags);
     return 0;
 }
 
 void pmm_free_pages(uint32_t addr, uint32_t n) {
     if (n == 0) return;
-    uint32_t page = addr / PAGE_SIZE;
-    for (uint32_t i = 0; i < n; ++i) {
-        uint32_t p = page + i;
-        if (p < BITMAP_SIZE * 32 && bitmap_test(p)) {
-            bitmap_clear(p);
-            used_pages--;
+    buddy_free_range(addr / PAGE_SIZE, n);
+}
+
+uint32_t pmm_alloc_user_page(void) {
+    uint32_t pfn = buddy_alloc_zones(user_zones, sizeof(user_zones), 0);
+    if (pfn == PFN_NONE) {
+        uint32_t addr = zero_pool_pop();
+        if (addr) {
+            page_db[addr / PAGE_SIZE].flags = PG_USER;
+        }
+        return addr;
+    }
+    page_db[pfn].flags = PG_USER;
+    return pfn * PAGE_SIZE;
+}
+
+// Kernel frame from any zone, highmem first. Such frames may lie outside
+// the identity map, so they are only touched through a mapping.
+uint32_t pmm_alloc_high_page(void) {
+    uint32_t pfn = buddy_alloc_zones(user_zones, sizeof(user_zones), 0);
+    if (pfn == PFN_NONE && pmm_reclaim()) {
+        pfn = buddy_alloc_zones(user_zones, sizeof(user_zones), 0);
+    }
+    if (pfn == PFN_NONE) {
+        return zero_pool_pop();
+    }
+    return pfn * PAGE_SIZE;
+}
+
+// 4MB-aligned run of frames for a large user page, highmem first. The
+// head frame carries PG_HUGE and the reference count of the whole run;
+// the frames are not cleared.
+uint32_t pmm_alloc_huge_user_page(void) {
+    uint32_t pfn = buddy_alloc_zones(user_zones, sizeof(user_zones), PMM_MAX_ORDER);
+    if (pfn == PFN_NONE) return 0;
+
+    for (uint32_t i = 0; i < HUGE_PAGE_PAGES; i++) {
+        page_db[pfn + i].flags = PG_USER;
+    }
+    page_db[pfn].flags |= PG_HUGE;
+    return pfn * PAGE_SIZE;
+}
+
+static uint32_t alloc_zeroed(uint8_t flags) {
+    uint32_t addr = zero_pool_pop();
+    if (!addr) {
+        addr = pmm_alloc_page();
+        if (!addr) return 0;
+        page_clear(addr);
+    }
+    page_db[addr / PAGE_SIZE].flags = flags;
+    return addr;
+}
+
+uint32_t pmm_alloc_zeroed_page(void) {
+    return alloc_zeroed(PG_KERNEL);
+}
+
+uint32_t pmm_alloc_zeroed_user_page(void) {
+    return alloc_zeroed(PG_USER);
+}
+
+// Clear one frame into the zero pool. Returns false once the pool is full
+// or memory is exhausted, so the idle loop knows it can halt.
+bool pmm_zero_pool_refill(void) {
+    if (zero_pool_count >= ZERO_POOL_SIZE) return false;
+
+    uint32_t pfn = buddy_alloc_zones(kernel_zones, sizeof(kernel_zones), 0);
+    if (pfn == PFN_NONE) return false;
+
+    // Clearing runs with interrupts enabled; only the push is atomic
+    page_clear(pfn * PAGE_SIZE);
+
+    uint32_t flags = irq_save();
+    bool pushed = zero_pool_count < ZERO_POOL_SIZE;
+    if (pushed) {
+        zero_pool[zero_pool_count++] = pfn * PAGE_SIZE;
+    }
+    irq_restore(flags);
+
+    if (!pushed) {
+        pmm_free_page(pfn * PAGE_SIZE);
+        return false;
+    }
+    return true;
+}
+
+struct page* pmm_get_page(uint32_t addr) {
+    uint32_t pfn = addr / PAGE_SIZE;
+    if (pfn >= max_pfn) return NULL;
+    return &page_db[pfn];
+}
+
+void page_get(uint32_t addr) {
+    struct page* page = pmm_get_page(addr);
+    uint32_t flags = irq_save();
+    if (page && !(page->flags & PG_FREE) && page->refcount < PAGE_REF_MAX) {
+        page->refcount++;
+    }
+    irq_restore(flags);
+}
+
+void page_put(uint32_t addr) {
+    struct page* page = pmm_get_page(addr);
+    if (!page || (page->flags & PG_FREE)) return;
+
+    // A saturated count is no longer exact, so that frame is never freed
+    if (page->refcount == PAGE_REF_MAX) return;
+
+    uint32_t flags = irq_save();
+    if (page->refcount > 1) {
+        page->refcount--;
+    } else if (page->flags & PG_HUGE) {
+        pmm_free_pages(addr & ~(HUGE_PAGE_SIZE - 1), HUGE_PAGE_PAGES);
+    } else {
+        pmm_free_page(addr & ~(PAGE_SIZE - 1));
+    }
+    irq_restore(flags);
+}
+
+#ifdef PMM_BENCH
+// Boot-time microbenchmark for the single-page fault path. Fills low memory,
+// leaves a few free pages at the top of the filled range and compares the old
+// first-fit bitmap scan against the buddy fast path. Build with DEFINES=-DPMM_BENCH.
+
+extern void log_info(const char* msg);
+extern void log_value(const char* label, uint32_t value, bool hex);
+
+#define BENCH_FILL_PAGES 16384
+#define BENCH_HOLES 64
+#define BENCH_ITERATIONS 1000
+
+static uint32_t bench_pages[BENCH_FILL_PAGES];
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// The pre-buddy allocator: first clear bit scanning from word 0
+static uint32_t bench_first_fit(void) {
+    for (uint32_t i = 0; i < bitmap_words; i++) {
+        if (bitmap[i] != 0xFFFFFFFF) {
+            for (uint32_t j = 0; j < 32; j++) {
+                if (!(bitmap[i] & (1 << j))) return i * 32 + j;
+            }
         }
     }
+    return PFN_NONE;
+}
+
+void pmm_benchmark(void) {
+    uint32_t filled = 0;
+    while (filled < BENCH_FILL_PAGES && pmm_get_free_pages() > BENCH_HOLES) {
+        uint32_t page = pmm_alloc_page();
+        if (!page) break;
+        bench_pages[filled++] = page;
+    }
+    if (filled <= BENCH_HOLES) {
+        for (uint32_t i = 0; i < filled; i++) pmm_free_page(bench_pages[i]);
+        log_info("PMM bench: not enough memory");
+        return;
+    }
+    for (uint32_t i = filled - BENCH_HOLES; i < filled; i++) {
+        pmm_free_page(bench_pages[i]);
+    }
+
+    volatile uint32_t sink = 0;
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        sink += bench_first_fit();
+    }
+    uint32_t scan_cycles = (uint32_t)(rdtsc() - start) / BENCH_ITERATIONS;
+
+    start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        uint32_t page = pmm_alloc_page();
+        pmm_free_page(page);
+    }
+    uint32_t buddy_cycles = (uint32_t)(rdtsc() - start) / BENCH_ITERATIONS;
+    (void)sink;
+
+    for (uint32_t i = 0; i < filled - BENCH_HOLES; i++) {
+        pmm_free_page(bench_pages[i]);
+    }
+
+    log_value("PMM bench: pages filled: ", filled, false);
+    log_value("PMM bench: first-fit scan cycles/op: ", scan_cycles, false);
+    log_value("PMM bench: buddy alloc+free cycles/op: ", buddy_cycles, false);
 }
+#endif
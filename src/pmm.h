@@ -5,6 +5,10 @@
 
 #define PAGE_SIZE 4096
 
+// Zone limits: DMA-capable memory and the kernel's identity-mapped range
+#define PMM_DMA_LIMIT        0x01000000
+#define PMM_DIRECT_MAP_LIMIT 0x40000000
+
 // Multiboot memory map entry
 struct multiboot_mmap_entry {
     uint32_t size;
@@ -27,6 +31,34 @@ struct multiboot_info {
     uint32_t mmap_addr;
 } __attribute__((packed));
 
+// Page frame flags
+#define PG_FREE    0x01  // On the buddy free lists
+#define PG_KERNEL  0x02  // Owned by the kernel
+#define PG_USER    0x04  // Mapped into user space
+#define PG_CACHE   0x08  // Holds cached file data
+#define PG_DIRTY   0x10  // Modified since it was last written back
+#define PG_SLAB    0x20  // Backs a slab cache; next points at the slab
+#define PG_HUGE    0x40  // Heads a run mapped as one 4MB user page
+
+// A reference count that reaches this sticks there and the frame is
+// never freed, rather than wrapping while mappings remain
+#define PAGE_REF_MAX 0xFFFF
+
+// Large user pages: one aligned top-order buddy block
+#define HUGE_PAGE_SIZE  0x400000
+#define HUGE_PAGE_PAGES (HUGE_PAGE_SIZE / PAGE_SIZE)
+
+// Page frame database entry, one per physical page
+struct page {
+    uint32_t next;       // Link (PFN), free-list chaining while the page is free
+    uint32_t prev;
+    uint16_t refcount;   // Number of users; the frame is freed when it drops to zero
+    uint8_t flags;
+    uint8_t order;       // Order of the free block this page heads
+    uint32_t owner_pd;   // Reverse map for user frames: page directory and
+    uint32_t vaddr;      // virtual address of the mapping
+};
+
 void pmm_init(struct multiboot_info* mboot);
 uint32_t pmm_alloc_page(void);
 void pmm_free_page(uint32_t addr);
@@ -34,5 +66,23 @@ uint32_t pmm_get_free_pages(void);
 uint32_t pmm_get_total_pages(void);
 uint32_t pmm_alloc_pages(uint32_t n);
 void pmm_free_pages(uint32_t addr, uint32_t n);
+uint32_t pmm_alloc_pages_constrained(uint32_t n, uint32_t max_addr, uint32_t boundary);
+uint32_t pmm_alloc_user_page(void);
+uint32_t pmm_alloc_high_page(void);
+uint32_t pmm_alloc_huge_user_page(void);
+uint32_t pmm_alloc_zeroed_page(void);
+uint32_t pmm_alloc_zeroed_user_page(void);
+bool pmm_zero_pool_refill(void);
+bool pmm_compact(uint32_t order);
+void pmm_get_compact_stats(uint32_t* attempts, uint32_t* successes, uint32_t* pages_moved);
+
+// Page frame database
+struct page* pmm_get_page(uint32_t addr);
+void page_get(uint32_t addr);
+void page_put(uint32_t addr);
+
+#ifdef PMM_BENCH
+void pmm_benchmark(void);
+#endif
 
 #endif
@@ -3,6 +3,9 @@
 #include "timer.h"
 #include "idt.h"
 #include "paging.h"
+#include "pmm.h"
+#include "slab.h"
+#include "gdt.h"
 
 // Process table
 static process_t process_table[MAX_PROCESSES];
@@ -10,19 +13,35 @@ static process_t* current_process = NULL;
 static process_t* ready_queue_head = NULL;
 static process_t* ready_queue_tail = NULL;
 static uint32_t next_pid = 1;
+static kmem_cache_t* kernel_stack_cache = NULL;
+static process_t* idle_thread = NULL;
+static void* exited_stack = NULL;  // Kernel stack of the last process to exit
 
 // External context switch function (defined in switch.asm)
 extern void context_switch(uint32_t* old_esp, uint32_t new_esp);
 
-// Idle process - runs when no other process is ready
+// Interrupt exit path (defined in isr.asm)
+extern void isr_return(void);
+
+static process_t* process_alloc(const char* name, uint32_t page_directory);
+
+// Idle thread - runs when no other process is ready. Spare cycles go to
+// pre-clearing frames for pmm_alloc_zeroed_page(); with the pool full it
+// halts until the next interrupt and looks for work again.
 static void idle_process(void) {
     while (1) {
-        hlt();
+        sti();
+        if (!pmm_zero_pool_refill()) {
+            hlt();
+        }
+        schedule();
     }
 }
 
 // Process wrapper to handle exit
 static void process_wrapper(void (*entry)(void)) {
+    // The switch here may have come from a path with interrupts off
+    sti();
     entry();
     process_exit(0);
 }
@@ -34,32 +53,52 @@ void process_init(void) {
         process_table[i].pid = 0;
     }
 
-    // Create idle process (PID 0)
-    process_t* idle = &process_table[0];
-    idle->pid = 0;
-    idle->state = PROCESS_STATE_READY;
-    idle->kernel_stack = (uint32_t)kmalloc(KERNEL_STACK_SIZE) + KERNEL_STACK_SIZE;
-    idle->page_directory = paging_kernel_pd_phys();
-    idle->parent = NULL;
-    idle->next = NULL;
-    
-    // Set up idle process stack
-    uint32_t* stack = (uint32_t*)idle->kernel_stack;
-    stack[-1] = (uint32_t)idle_process;  // Return address (entry point)
-    stack[-2] = 0;  // EBP
-    stack[-3] = 0;  // EBX
-    stack[-4] = 0;  // ESI
-    stack[-5] = 0;  // EDI
-    idle->esp = (uint32_t)&stack[-5];
-
-    // Copy name
-    const char* name = "idle";
+    kernel_stack_cache = kmem_cache_create("kernel_stack", KERNEL_STACK_SIZE, 16, NULL);
+    vma_init();
+
+    // PID 0 is the boot thread, already running. It goes on to exec the
+    // shell and keeps taking interrupts from user mode on the stack kmain
+    // gave the TSS.
+    process_t* boot = &process_table[0];
+    boot->pid = 0;
+    boot->state = PROCESS_STATE_RUNNING;
+    boot->kernel_stack = tss_get_kernel_stack();
+    boot->page_directory = paging_kernel_pd_phys();
+    boot->vmas = NULL;
+    boot->parent = NULL;
+    boot->next = NULL;
+
+    const char* name = "kernel";
     for (int i = 0; i < 31 && name[i]; i++) {
-        idle->name[i] = name[i];
-        idle->name[i + 1] = '\0';
+        boot->name[i] = name[i];
+        boot->name[i + 1] = '\0';
     }
 
-    current_process = idle;
+    current_process = boot;
+
+    // The idle thread is never queued; schedule() falls back to it
+    idle_thread = process_alloc("idle", paging_kernel_pd_phys());
+    if (idle_thread) {
+        idle_thread->parent = NULL;
+
+        uint32_t* stack = (uint32_t*)idle_thread->kernel_stack;
+        stack[-1] = (uint32_t)idle_process;  // EIP
+        stack[-2] = 0;                       // EBX
+        stack[-3] = 0;                       // ESI
+        stack[-4] = 0;                       // EDI
+        stack[-5] = 0;                       // EBP
+        idle_thread->esp = (uint32_t)&stack[-5];
+        idle_thread->state = PROCESS_STATE_READY;
+    }
+}
+
+// An exiting process still runs on its kernel stack until it switches
+// away for good, so the stack is freed by whoever comes next
+static void free_exited_stack(void) {
+    if (exited_stack) {
+        kmem_cache_free(kernel_stack_cache, exited_stack);
+        exited_stack = NULL;
+    }
 }
 
 static process_t* find_free_slot(void) {
@@ -71,53 +110,69 @@ static process_t* find_free_slot(void) {
     return NULL;
 }
 
-process_t* process_create(const char* name, void (*entry)(void)) {
+// Claim a slot with a fresh PID, an address space and a kernel stack
+static process_t* process_alloc(const char* name, uint32_t page_directory) {
     process_t* proc = find_free_slot();
     if (!proc) return NULL;
 
+    free_exited_stack();
+
     proc->pid = next_pid++;
     proc->state = PROCESS_STATE_CREATED;
     proc->parent = current_process;
     proc->next = NULL;
     proc->exit_code = 0;
     proc->sleep_until = 0;
-    proc->page_directory = paging_clone_pd();
-    if (!proc->page_directory) {
-        kfree((void*)(proc->kernel_stack - KERNEL_STACK_SIZE));
-        proc->state = PROCESS_STATE_UNUSED;
-        return NULL;
-    }
+    proc->scratch.base = NULL;
+    proc->scratch.size = 0;
+    proc->scratch.top = 0;
+    proc->vmas = NULL;
+    proc->page_directory = page_directory;
 
     // Allocate kernel stack
-    proc->kernel_stack = (uint32_t)kmalloc(KERNEL_STACK_SIZE);
+    proc->kernel_stack = (uint32_t)kmem_cache_alloc(kernel_stack_cache);
     if (!proc->kernel_stack) {
         proc->state = PROCESS_STATE_UNUSED;
         return NULL;
     }
     proc->kernel_stack += KERNEL_STACK_SIZE;  // Stack grows down
 
+    // Copy name
+    int i;
+    for (i = 0; i < 31 && name[i]; i++) {
+        proc->name[i] = name[i];
+    }
+    proc->name[i] = '\0';
+
+    return proc;
+}
+
+process_t* process_create(const char* name, void (*entry)(void)) {
+    uint32_t page_directory = paging_clone_pd();
+    if (!page_directory) return NULL;
+
+    process_t* proc = process_alloc(name, page_directory);
+    if (!proc) {
+        pmm_free_page(page_directory);
+        return NULL;
+    }
+
     // Set up initial stack frame
     uint32_t* stack = (uint32_t*)proc->kernel_stack;
     
     // Set up stack for context_switch to work
-    // When context_switch returns, it will pop these and "return" to process_wrapper
+    // When context_switch returns, it pops EBP, EDI, ESI and EBX, then
+    // "returns" to process_wrapper
     stack[-1] = (uint32_t)entry;           // Argument to process_wrapper
     stack[-2] = 0;                          // Fake return address
     stack[-3] = (uint32_t)process_wrapper;  // EIP - entry point
-    stack[-4] = 0;                          // EBP
-    stack[-5] = 0;                          // EBX
-    stack[-6] = 0;                          // ESI
-    stack[-7] = 0;                          // EDI
+    stack[-4] = 0;                          // EBX
+    stack[-5] = 0;                          // ESI
+    stack[-6] = 0;                          // EDI
+    stack[-7] = 0;                          // EBP
     
     proc->esp = (uint32_t)&stack[-7];
 
-    // Copy name
-    int i;
-    for (i = 0; i < 31 && name[i]; i++) {
-        proc->name[i] = name[i];
-    }
-    proc->name[i] = '\0';
-
     // Add to ready queue
     proc->state = PROCESS_STATE_READY;
     scheduler_add(proc);
@@ -125,17 +180,121 @@ process_t* process_create(const char* name, void (*entry)(void)) {
     return proc;
 }
 
+// Duplicate the current process. The child shares the parent's user
+// frames copy-on-write and resumes from the same interrupt frame, with
+// fork() returning 0.
+process_t* process_fork(struct registers* regs) {
+    uint32_t page_directory = paging_fork_pd();
+    if (!page_directory) return NULL;
+
+    process_t* proc = process_alloc(current_process->name, page_directory);
+    if (!proc) {
+        paging_destroy_pd(page_directory);
+        return NULL;
+    }
+    if (!vma_clone(proc, current_process)) {
+        kmem_cache_free(kernel_stack_cache, (void*)(proc->kernel_stack - KERNEL_STACK_SIZE));
+        paging_destroy_pd(page_directory);
+        proc->state = PROCESS_STATE_UNUSED;
+        return NULL;
+    }
+
+    // Copy of the parent's frame at the top of the child's kernel stack,
+    // below it a context_switch frame returning into the interrupt exit path
+    struct registers* frame = (struct registers*)(proc->kernel_stack - sizeof(struct registers));
+    *frame = *regs;
+    frame->eax = 0;
+
+    uint32_t* stack = (uint32_t*)frame;
+    stack[-1] = (uint32_t)isr_return;       // EIP
+    stack[-2] = 0;                          // EBX
+    stack[-3] = 0;                          // ESI
+    stack[-4] = 0;                          // EDI
+    stack[-5] = 0;                          // EBP
+    proc->esp = (uint32_t)&stack[-5];
+
+    proc->state = PROCESS_STATE_READY;
+    scheduler_add(proc);
+    return proc;
+}
+
+// Wait for a child to exit and release its slot. Returns the child's
+// exit code, or -1 if pid is not a child of the caller.
+int32_t process_wait(uint32_t pid) {
+    process_t* child = NULL;
+    for (int i = 1; i < MAX_PROCESSES; i++) {
+        if (process_table[i].state != PROCESS_STATE_UNUSED && process_table[i].pid == pid &&
+            process_table[i].parent == current_process) {
+            child = &process_table[i];
+            break;
+        }
+    }
+    if (!child) return -1;
+
+    // The child must not exit between the check and blocking, or the
+    // wakeup finds us still running and is lost
+    uint32_t flags = irq_save();
+    while (child->state != PROCESS_STATE_TERMINATED) {
+        current_process->state = PROCESS_STATE_BLOCKED;
+        schedule();
+    }
+    irq_restore(flags);
+
+    int32_t code = child->exit_code;
+    child->state = PROCESS_STATE_UNUSED;
+    child->pid = 0;
+    return code;
+}
+
 void process_exit(int32_t code) {
     if (!current_process || current_process->pid == 0) {
-        // Can't exit idle process
+        // Can't exit the boot thread
         return;
     }
 
-    current_process->exit_code = code;
-    current_process->state = PROCESS_STATE_TERMINATED;
+    process_t* proc = current_process;
+    proc->exit_code = code;
+    proc->state = PROCESS_STATE_TERMINATED;
+
+    // Tear down the address space from the kernel directory: every user
+    // frame loses this process's reference and goes back to the PMM
+    // unless another process still maps it
+    vma_free_all(&proc->vmas);
+    if (proc->page_directory != paging_kernel_pd_phys()) {
+        uint32_t page_directory = proc->page_directory;
+        paging_switch(paging_kernel_pd_phys());
+        proc->page_directory = paging_kernel_pd_phys();
+        paging_destroy_pd(page_directory);
+    }
+
+    // Free scratch arena; the kernel stack goes once we are off it
+    arena_destroy(&proc->scratch);
+    free_exited_stack();
+    exited_stack = (void*)(proc->kernel_stack - KERNEL_STACK_SIZE);
+
+    // Nobody will wait for our children: exited ones are released now,
+    // the rest release themselves
+    for (int i = 1; i < MAX_PROCESSES; i++) {
+        process_t* child = &process_table[i];
+        if (child->state == PROCESS_STATE_UNUSED || child->parent != proc) continue;
+
+        child->parent = NULL;
+        if (child->state == PROCESS_STATE_TERMINATED) {
+            child->state = PROCESS_STATE_UNUSED;
+            child->pid = 0;
+        }
+    }
 
-    // Free kernel stack
-    kfree((void*)(current_process->kernel_stack - KERNEL_STACK_SIZE));
+    // Wake a parent blocked in process_wait(), or release the slot if
+    // there is no one to collect the exit code
+    process_t* parent = proc->parent;
+    if (!parent) {
+        proc->state = PROCESS_STATE_UNUSED;
+        proc->pid = 0;
+    } else if (parent->state == PROCESS_STATE_BLOCKED) {
+        parent->state = PROCESS_STATE_READY;
+        scheduler_add(parent);
+    }
 
     // Switch to another process
     schedule();
@@ -245,7 +404,7 @@ void schedule(void) {
         next->next = NULL;
     } else {
         // No ready process, run idle
-        next = &process_table[0];
+        next = idle_thread ? idle_thread : &process_table[0];
     }
 
     if (next == current_process) {
@@ -261,6 +420,7 @@ void schedule(void) {
     if (prev->page_directory != current_process->page_directory) {
         paging_switch(current_process->page_directory);
     }
+    tss_set_kernel_stack(next->kernel_stack);
 
     context_switch(&prev->esp, next->esp);
 }
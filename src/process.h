@@ -2,6 +2,9 @@
 #define PROCESS_H
 
 #include "types.h"
+#include "arena.h"
+#include "vma.h"
+#include "idt.h"
 
 #define MAX_PROCESSES 256
 #define KERNEL_STACK_SIZE 4096
@@ -35,6 +38,7 @@ struct process {
     uint32_t esp;                    // Stack pointer
     uint32_t kernel_stack;           // Kernel stack base
     uint32_t page_directory;         // Page directory physical address
+    vm_area_t* vmas;                 // User address space areas, sorted
     
     uint32_t sleep_until;            // Timer tick to wake up (for sleeping)
     int32_t exit_code;               // Exit code
@@ -42,6 +46,8 @@ struct process {
     struct process* parent;          // Parent process
     struct process* next;            // Next in queue (for scheduler)
     
+    arena_t scratch;                 // Per-operation scratch memory
+    
     char name[32];                   // Process name
 };
 
@@ -50,6 +56,8 @@ typedef struct process process_t;
 // Process management
 void process_init(void);
 process_t* process_create(const char* name, void (*entry)(void));
+process_t* process_fork(struct registers* regs);
+int32_t process_wait(uint32_t pid);
 void process_exit(int32_t code);
 void process_yield(void);
 void process_sleep(uint32_t ms);
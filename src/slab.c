@@ -0,0 +1,235 @@
+#include "slab.h"
+#include "heap.h"
+#include "pmm.h"
+
+// Slab allocator for fixed-size kernel objects. Each cache carves objects
+// out of page-backed slabs; free objects are chained by index so their
+// constructed state is never overwritten.
+
+#define SLAB_END 0xFFFF
+#define SLAB_MAX_PAGES 16
+#define SLAB_OFF_SLAB_SIZE (PAGE_SIZE / 8)  // Larger objects keep the descriptor off-slab
+#define SLAB_MAX_WASTE 8                    // Accept at most 1/8 of a slab unused
+
+// Slab descriptor, at the start of the slab pages or kmalloc'd when off-slab
+struct slab {
+    struct slab* next;
+    struct slab* prev;
+    kmem_cache_t* cache;
+    uint32_t pages;          // Address of the slab pages
+    uint16_t in_use;
+    uint16_t free_head;      // First free object index, SLAB_END when full
+    uint16_t free_next[];    // Next free object index, per object
+};
+
+static kmem_cache_t* cache_list = NULL;
+
+static uint32_t slab_desc_size(uint32_t objects) {
+    return (sizeof(struct slab) + objects * sizeof(uint16_t) + 7) & ~7;
+}
+
+static void slab_list_add(struct slab** head, struct slab* slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) (*head)->prev = slab;
+    *head = slab;
+}
+
+static void slab_list_remove(struct slab** head, struct slab* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *head = slab->next;
+    }
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+// Objects that fit in a slab of the given size; sets the first object offset
+static uint32_t slab_layout(kmem_cache_t* cache, uint32_t pages, uint32_t align, uint32_t* offset) {
+    uint32_t bytes = pages * PAGE_SIZE;
+    uint32_t objects = bytes / cache->object_size;
+    if (objects > SLAB_END - 1) objects = SLAB_END - 1;
+
+    *offset = 0;
+    if (cache->off_slab) return objects;
+
+    while (objects > 0) {
+        *offset = (slab_desc_size(objects) + align - 1) & ~(align - 1);
+        if (*offset + objects * cache->object_size <= bytes) break;
+        objects--;
+    }
+    return objects;
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor_t ctor) {
+    if (size == 0) return NULL;
+    if (align < sizeof(void*)) align = sizeof(void*);
+
+    kmem_cache_t* cache = (kmem_cache_t*)kmalloc(sizeof(kmem_cache_t));
+    if (!cache) return NULL;
+
+    cache->name = name;
+    cache->object_size = (size + align - 1) & ~(align - 1);
+    cache->off_slab = cache->object_size >= SLAB_OFF_SLAB_SIZE;
+    cache->ctor = ctor;
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->active_objects = 0;
+
+    // Smallest power-of-two slab that holds an object without much waste
+    uint32_t pages = 1;
+    while (pages * PAGE_SIZE < cache->object_size) pages <<= 1;
+
+    uint32_t objects = 0;
+    uint32_t offset = 0;
+    for (; pages <= SLAB_MAX_PAGES; pages <<= 1) {
+        objects = slab_layout(cache, pages, align, &offset);
+        uint32_t waste = pages * PAGE_SIZE - offset - objects * cache->object_size;
+        if (objects && waste * SLAB_MAX_WASTE <= pages * PAGE_SIZE) break;
+    }
+    if (pages > SLAB_MAX_PAGES) {
+        pages = SLAB_MAX_PAGES;
+        objects = slab_layout(cache, pages, align, &offset);
+    }
+    if (!objects) {
+        kfree(cache);
+        return NULL;
+    }
+
+    cache->slab_pages = pages;
+    cache->objects_per_slab = objects;
+    cache->first_offset = offset;
+
+    cache->next = cache_list;
+    cache_list = cache;
+    return cache;
+}
+
+static struct slab* slab_create(kmem_cache_t* cache) {
+    uint32_t pages = pmm_alloc_pages(cache->slab_pages);
+    if (!pages) return NULL;
+
+    struct slab* slab;
+    if (cache->off_slab) {
+        slab = (struct slab*)kmalloc(slab_desc_size(cache->objects_per_slab));
+        if (!slab) {
+            pmm_free_pages(pages, cache->slab_pages);
+            return NULL;
+        }
+    } else {
+        slab = (struct slab*)pages;
+    }
+
+    slab->cache = cache;
+    slab->pages = pages;
+    slab->in_use = 0;
+    slab->free_head = 0;
+    slab->next = NULL;
+    slab->prev = NULL;
+
+    for (uint32_t i = 0; i < cache->objects_per_slab; i++) {
+        slab->free_next[i] = (i + 1 < cache->objects_per_slab) ? i + 1 : SLAB_END;
+        if (cache->ctor) {
+            cache->ctor((void*)(pages + cache->first_offset + i * cache->object_size));
+        }
+    }
+
+    // Let kmem_free() find the slab from any object address
+    for (uint32_t i = 0; i < cache->slab_pages; i++) {
+        struct page* page = pmm_get_page(pages + i * PAGE_SIZE);
+        page->flags |= PG_SLAB;
+        page->next = (uint32_t)slab;
+    }
+    return slab;
+}
+
+static void slab_destroy(kmem_cache_t* cache, struct slab* slab) {
+    uint32_t pages = slab->pages;
+
+    for (uint32_t i = 0; i < cache->slab_pages; i++) {
+        pmm_get_page(pages + i * PAGE_SIZE)->flags &= ~PG_SLAB;
+    }
+    if (cache->off_slab) {
+        kfree(slab);
+    }
+    pmm_free_pages(pages, cache->slab_pages);
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    if (!cache) return NULL;
+
+    struct slab* slab = cache->partial;
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            slab_list_remove(&cache->empty, slab);
+        } else {
+            slab = slab_create(cache);
+            if (!slab) return NULL;
+        }
+        slab_list_add(&cache->partial, slab);
+    }
+
+    uint32_t index = slab->free_head;
+    slab->free_head = slab->free_next[index];
+    slab->in_use++;
+    cache->active_objects++;
+
+    if (slab->free_head == SLAB_END) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+
+    return (void*)(slab->pages + cache->first_offset + index * cache->object_size);
+}
+
+static struct slab* slab_of(void* obj) {
+    // Slab pages are identity mapped; anything above cannot be a slab object
+    if ((uint32_t)obj >= PMM_DIRECT_MAP_LIMIT) return NULL;
+
+    struct page* page = pmm_get_page((uint32_t)obj);
+    if (!page || !(page->flags & PG_SLAB)) return NULL;
+    return (struct slab*)page->next;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    if (!obj) return;
+
+    struct slab* slab = slab_of(obj);
+    if (!slab || slab->cache != cache) return;
+
+    uint32_t index = ((uint32_t)obj - slab->pages - cache->first_offset) / cache->object_size;
+    bool was_full = slab->free_head == SLAB_END;
+
+    slab->free_next[index] = slab->free_head;
+    slab->free_head = index;
+    slab->in_use--;
+    cache->active_objects--;
+
+    if (was_full) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    if (slab->in_use == 0) {
+        slab_list_remove(&cache->partial, slab);
+        if (cache->empty) {
+            slab_destroy(cache, slab);
+        } else {
+            slab_list_add(&cache->empty, slab);
+        }
+    }
+}
+
+// Free an object without knowing its cache. Returns false if obj is not
+// a slab object.
+bool kmem_free(void* obj) {
+    struct slab* slab = slab_of(obj);
+    if (!slab) return false;
+
+    kmem_cache_free(slab->cache, obj);
+    return true;
+}
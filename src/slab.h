@@ -0,0 +1,33 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "types.h"
+
+typedef void (*kmem_ctor_t)(void* obj);
+
+struct slab;
+
+// Object cache: fixed-size objects carved from page-backed slabs
+typedef struct kmem_cache {
+    const char* name;
+    uint32_t object_size;       // Object size rounded up to the alignment
+    uint32_t objects_per_slab;
+    uint32_t slab_pages;        // Pages per slab
+    uint32_t first_offset;      // Offset of the first object within the slab
+    bool off_slab;              // Slab descriptor lives outside the slab pages
+    kmem_ctor_t ctor;           // Run once per object when its slab is created
+
+    struct slab* partial;       // Slabs with both free and used objects
+    struct slab* full;
+    struct slab* empty;         // At most one empty slab is kept around
+    uint32_t active_objects;
+
+    struct kmem_cache* next;
+} kmem_cache_t;
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor_t ctor);
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+bool kmem_free(void* obj);
+
+#endif
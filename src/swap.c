@@ -0,0 +1,218 @@
+#include "swap.h"
+#include "ata.h"
+#include "pmm.h"
+#include "paging.h"
+#include "vmalloc.h"
+#include "heap.h"
+
+extern void log_info(const char* msg);
+extern void log_value(const char* label, uint32_t value, bool hex);
+
+// Anonymous user pages are paged out to the first ATA drive after the
+// boot disk that carries a swap header. The header fills the first page;
+// the page-sized slots follow it, so slot n starts at page n. A paged-out
+// mapping keeps its slot number in the non-present PTE (PAGE_SWAPPED).
+// Victims are chosen with a clock scan over the frame database: a frame
+// whose accessed bit is set gets a second chance, the next one it meets
+// unaccessed is written out.
+
+#define SECTORS_PER_PAGE (PAGE_SIZE / 512)
+#define SWAP_MAX_SLOTS   65536   // 256MB of swap at most
+#define SWAP_NO_DRIVE    0xFF
+#define SWAP_MAGIC       "FLOWSWAP"
+
+// Sector 0 of a swap drive, written when the image is made
+struct swap_header {
+    char magic[8];
+    uint32_t slots;     // Page slots after the header page
+} __attribute__((packed));
+
+static uint8_t swap_drive = SWAP_NO_DRIVE;
+static uint32_t swap_slots = 0;     // Slot 0 is the header, so entries are never 0
+static uint32_t swap_used = 0;
+static uint16_t* slot_refs = NULL;  // PTEs pointing at each slot
+static uint32_t slot_hint = 1;      // Where the next free slot search starts
+static uint32_t clock_hand = 0;     // Next PFN the replacement scan looks at
+
+static uint32_t page_ins = 0;
+static uint32_t page_outs = 0;
+
+static inline uint32_t pte_slot(uint32_t pte) {
+    return pte >> 12;
+}
+
+// Number of slots, header included, the drive is set up for, or 0 if it
+// does not carry a valid swap header. Anything else on the drive is
+// somebody's data.
+static uint32_t swap_probe(uint8_t drive) {
+    struct ata_drive* d = ata_get_drive(drive);
+    if (!d || d->sectors < 2 * SECTORS_PER_PAGE) return 0;
+
+    uint8_t* sector = (uint8_t*)kmalloc(512);
+    if (!sector) return 0;
+
+    uint32_t slots = 0;
+    if (ata_read_sectors(drive, 0, 1, sector)) {
+        struct swap_header* header = (struct swap_header*)sector;
+        bool magic_ok = true;
+        for (int i = 0; i < 8; i++) {
+            if (header->magic[i] != SWAP_MAGIC[i]) magic_ok = false;
+        }
+        if (magic_ok && header->slots && header->slots < d->sectors / SECTORS_PER_PAGE) {
+            slots = header->slots + 1;
+        }
+    }
+    kfree(sector);
+    return slots;
+}
+
+void swap_init(void) {
+    for (uint8_t drive = 1; drive < 4; drive++) {
+        uint32_t slots = swap_probe(drive);
+        if (!slots) continue;
+        if (slots > SWAP_MAX_SLOTS) slots = SWAP_MAX_SLOTS;
+
+        slot_refs = (uint16_t*)vmalloc(slots * sizeof(uint16_t));
+        if (!slot_refs) break;
+        for (uint32_t i = 0; i < slots; i++) {
+            slot_refs[i] = 0;
+        }
+
+        swap_drive = drive;
+        swap_slots = slots;
+        log_info("Swap: Enabled on secondary ATA drive");
+        return;
+    }
+    log_info("Swap: No drive with a swap header, paging out disabled");
+}
+
+static uint32_t slot_alloc(void) {
+    if (swap_used + 1 >= swap_slots) return 0;
+
+    for (uint32_t n = 1; n < swap_slots; n++) {
+        uint32_t slot = slot_hint;
+        slot_hint = (slot_hint + 1 < swap_slots) ? slot_hint + 1 : 1;
+        if (!slot_refs[slot]) {
+            slot_refs[slot] = 1;
+            swap_used++;
+            return slot;
+        }
+    }
+    return 0;
+}
+
+static void slot_put(uint32_t slot) {
+    if (!slot || slot >= swap_slots || !slot_refs[slot]) return;
+
+    if (--slot_refs[slot] == 0) {
+        swap_used--;
+    }
+}
+
+// Another PTE now holds the entry, e.g. a forked copy
+void swap_dup(uint32_t pte) {
+    uint32_t slot = pte_slot(pte);
+    if (slot && slot < swap_slots && slot_refs[slot] < 0xFFFF) {
+        slot_refs[slot]++;
+    }
+}
+
+// A PTE holding the entry went away
+void swap_free(uint32_t pte) {
+    slot_put(pte_slot(pte));
+}
+
+// Write the frame to a fresh slot and turn its only mapping into a swap
+// entry. The frame is freed.
+static bool swap_out_frame(uint32_t frame, struct page* page) {
+    uint32_t slot = slot_alloc();
+    if (!slot) return false;
+
+    void* buffer = kmap_temp(frame);
+    if (!buffer) {
+        slot_put(slot);
+        return false;
+    }
+    bool ok = ata_write_sectors(swap_drive, slot * SECTORS_PER_PAGE, SECTORS_PER_PAGE, buffer);
+    kunmap_temp(buffer);
+    if (!ok) {
+        slot_put(slot);
+        return false;
+    }
+
+    paging_set_pte(page->owner_pd, page->vaddr, (slot << 12) | PAGE_SWAPPED);
+    page_put(frame);
+    page_outs++;
+    return true;
+}
+
+// Page out up to count anonymous user frames. Only frames with a single
+// mapping are considered; shared ones would need every mapping updated.
+// Returns the number of frames freed.
+uint32_t swap_out(uint32_t count) {
+    if (swap_drive == SWAP_NO_DRIVE) return 0;
+
+    uint32_t freed = 0;
+    uint32_t wraps = 0;
+
+    // The first sweep may only clear accessed bits; the second finds them
+    // still clear unless the page was used in between
+    while (freed < count && wraps < 3) {
+        uint32_t frame = clock_hand * PAGE_SIZE;
+        struct page* page = pmm_get_page(frame);
+        if (!page) {
+            clock_hand = 0;
+            wraps++;
+            continue;
+        }
+        clock_hand++;
+
+        if (!(page->flags & PG_USER) || (page->flags & PG_CACHE) ||
+            page->refcount != 1 || !page->owner_pd) {
+            continue;
+        }
+
+        uint32_t pte = paging_get_pte(page->owner_pd, page->vaddr);
+        if (!(pte & PAGE_PRESENT) || (pte & 0xFFFFF000) != frame) continue;
+
+        if (pte & PAGE_ACCESSED) {
+            paging_set_pte(page->owner_pd, page->vaddr, pte & ~PAGE_ACCESSED);
+            continue;
+        }
+
+        if (swap_out_frame(frame, page)) {
+            freed++;
+        }
+    }
+    return freed;
+}
+
+// Read the page behind a swap entry into frame and drop the entry's
+// reference on its slot
+bool swap_in(uint32_t pte, uint32_t frame) {
+    uint32_t slot = pte_slot(pte);
+    if (swap_drive == SWAP_NO_DRIVE || !slot || slot >= swap_slots) return false;
+
+    void* buffer = kmap_temp(frame);
+    if (!buffer) return false;
+    bool ok = ata_read_sectors(swap_drive, slot * SECTORS_PER_PAGE, SECTORS_PER_PAGE, buffer);
+    kunmap_temp(buffer);
+    if (!ok) return false;
+
+    slot_put(slot);
+    page_ins++;
+    return true;
+}
+
+void swap_get_stats(uint32_t* ins, uint32_t* outs) {
+    if (ins) *ins = page_ins;
+    if (outs) *outs = page_outs;
+}
+
+void swap_dump_stats(void) {
+    log_info("Swap statistics:");
+    log_value("  slots:     ", swap_slots ? swap_slots - 1 : 0, false);
+    log_value("  used:      ", swap_used, false);
+    log_value("  page-ins:  ", page_ins, false);
+    log_value("  page-outs: ", page_outs, false);
+}
@@ -0,0 +1,14 @@
+#ifndef SWAP_H
+#define SWAP_H
+
+#include "types.h"
+
+void swap_init(void);
+uint32_t swap_out(uint32_t count);
+bool swap_in(uint32_t pte, uint32_t frame);
+void swap_dup(uint32_t pte);
+void swap_free(uint32_t pte);
+void swap_get_stats(uint32_t* ins, uint32_t* outs);
+void swap_dump_stats(void);
+
+#endif
@@ -1,5 +1,8 @@
 #include "syscalls.h"
 #include "idt.h"
+#include "heap.h"
+#include "process.h"
+#include "swap.h"
 
 // Extern functions
 extern void log_info(const char* msg);
@@ -7,16 +10,32 @@ extern char keyboard_get_char(void);
 extern int elf_exec(const char* path);
 
 static void sys_exit(int code) {
-    (void)code;
     log_info("Process exited");
-    // For now, just halt - later we'll implement proper process termination
+    process_exit(code);
+
+    // The boot process cannot exit; halt
     while(1) __asm__ __volatile__("hlt");
 }
 
+// Returns the child's PID to the parent; the child sees 0
+static int sys_fork(struct registers* regs) {
+    process_t* child = process_fork(regs);
+    return child ? (int)child->pid : -1;
+}
+
+static int sys_wait(uint32_t pid) {
+    return process_wait(pid);
+}
+
 // External VGA functions from kernel
 extern void vga_put_char(char c);
 
 static int sys_read(char* buffer, int max_len) {
+    if (max_len <= 0 ||
+        !vma_access_ok(process_get_current(), (uint32_t)buffer, max_len, true)) {
+        return -1;
+    }
+
     int i = 0;
     while (i < max_len - 1) {
         char c = keyboard_get_char();
@@ -43,13 +62,21 @@ static int sys_read(char* buffer, int max_len) {
 }
 
 static void sys_write(char* str) {
+    if (!vma_string_ok(process_get_current(), str)) return;
     log_info(str);
 }
 
 static int sys_exec(const char* path) {
+    if (!vma_string_ok(process_get_current(), path)) return -1;
     return elf_exec(path);
 }
 
+// Dump kernel heap and swap statistics over serial
+static void sys_meminfo(void) {
+    heap_dump_stats();
+    swap_dump_stats();
+}
+
 void syscall_handler(struct registers* regs) {
     // EAX = syscall number
     // EBX, ECX, EDX = arguments
@@ -64,6 +91,9 @@ void syscall_handler(struct registers* regs) {
         case SYS_EXIT:
             sys_exit(regs->ebx);
             break;
+        case SYS_FORK:
+            ret = sys_fork(regs);
+            break;
         case SYS_READ:
             ret = sys_read((char*)regs->ebx, regs->ecx);
             break;
@@ -73,6 +103,12 @@ void syscall_handler(struct registers* regs) {
         case SYS_EXEC:
             ret = sys_exec((const char*)regs->ebx);
             break;
+        case SYS_WAIT:
+            ret = sys_wait(regs->ebx);
+            break;
+        case SYS_MEMINFO:
+            sys_meminfo();
+            break;
         default:
             log_info("Unknown Syscall");
             ret = -1;
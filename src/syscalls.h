@@ -5,9 +5,12 @@
 #include "idt.h"
 
 #define SYS_EXIT  1
+#define SYS_FORK  2
 #define SYS_READ  3
 #define SYS_WRITE 4
+#define SYS_WAIT  7
 #define SYS_EXEC  11
+#define SYS_MEMINFO 20
 
 void syscall_init(void);
 void syscall_handler(struct registers* regs);
@@ -51,6 +51,19 @@ static inline void sti(void) {
     __asm__ __volatile__("sti");
 }
 
+// Disable interrupts, returning the previous EFLAGS for irq_restore()
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    if (flags & 0x200) {
+        sti();
+    }
+}
+
 static inline void hlt(void) {
     __asm__ __volatile__("hlt");
 }
@@ -1,7 +1,38 @@
 #include "vfs.h"
+#include "slab.h"
 
 fs_node_t* fs_root = 0; // The root of the filesystem.
 
+// Every node handed out, by the drivers or as a private copy, comes from
+// one object cache and goes back through kfree() or vfs_node_free()
+static kmem_cache_t* fs_node_cache;
+
+static void fs_node_ctor(void* obj) {
+    uint8_t* p = (uint8_t*)obj;
+    for (uint32_t i = 0; i < sizeof(fs_node_t); i++) p[i] = 0;
+}
+
+void vfs_init(void) {
+    fs_node_cache = kmem_cache_create("fs_node", sizeof(fs_node_t), 0, fs_node_ctor);
+}
+
+fs_node_t* vfs_node_alloc(void) {
+    return (fs_node_t*)kmem_cache_alloc(fs_node_cache);
+}
+
+// Private copy of a node, for holders that outlive the caller's
+fs_node_t* vfs_node_dup(fs_node_t* node) {
+    fs_node_t* copy = vfs_node_alloc();
+    if (copy) {
+        *copy = *node;
+    }
+    return copy;
+}
+
+void vfs_node_free(fs_node_t* node) {
+    kmem_cache_free(fs_node_cache, node);
+}
+
 uint32_t vfs_read(fs_node_t* node, uint32_t offset, uint32_t size, uint8_t* buffer) {
     // Has the node got a read callback?
     if (node->read != 0)
@@ -46,6 +46,12 @@ struct dirent {
 
 extern fs_node_t* fs_root; // The root of the filesystem.
 
+// Node allocation
+void vfs_init(void);
+fs_node_t* vfs_node_alloc(void);
+fs_node_t* vfs_node_dup(fs_node_t* node);
+void vfs_node_free(fs_node_t* node);
+
 // Standard VFS functions
 uint32_t vfs_read(fs_node_t* node, uint32_t offset, uint32_t size, uint8_t* buffer);
 uint32_t vfs_write(fs_node_t* node, uint32_t offset, uint32_t size, uint8_t* buffer);
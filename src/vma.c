@@ -0,0 +1,471 @@
+#include "vma.h"
+#include "process.h"
+#include "paging.h"
+#include "slab.h"
+#include "arena.h"
+#include "pagecache.h"
+#include "swap.h"
+
+#define FAULT_AROUND_PAGES 8  // Aligned window a file fault fills at once
+#define RECLAIM_PAGES      8  // Frames to free when a fault finds memory exhausted
+
+// Each process describes its user address space as a sorted list of
+// areas. The page fault handler only populates pages that fall inside
+// an area, with whatever the area's backing calls for; anything else is
+// a bad access.
+
+static kmem_cache_t* vma_cache;
+
+// Read faults on anonymous memory all map this one frame, read-only;
+// the first write swaps in a private page
+static uint32_t zero_frame;
+
+void vma_init(void) {
+    vma_cache = kmem_cache_create("vm_area", sizeof(vm_area_t), 0, NULL);
+    pagecache_init();
+    zero_frame = pmm_alloc_zeroed_page();
+}
+
+static void vma_free(vm_area_t* vma) {
+    if (vma->file) {
+        vfs_node_free(vma->file);
+    }
+    kmem_cache_free(vma_cache, vma);
+}
+
+// Add an area covering [start, end) to a sorted area list, usually a
+// process's. Fails if it overlaps an existing one or leaves user space.
+// File areas keep their own copy of the node, so the caller still owns
+// the one it passed.
+vm_area_t* vma_map(vm_area_t** list, uint32_t start, uint32_t end, uint32_t flags,
+                   vma_type_t type, fs_node_t* file, uint32_t file_offset, uint32_t file_size) {
+    start &= 0xFFFFF000;
+    end = (end + PAGE_SIZE - 1) & 0xFFFFF000;
+    if (!list || start >= end) return NULL;
+    if (start < USER_SPACE_BASE || end > KERNEL_SPACE_BASE) return NULL;
+
+    vm_area_t** link = list;
+    while (*link && (*link)->end <= start) {
+        link = &(*link)->next;
+    }
+    if (*link && (*link)->start < end) return NULL;
+
+    vm_area_t* vma = (vm_area_t*)kmem_cache_alloc(vma_cache);
+    if (!vma) return NULL;
+
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma->type = type;
+    vma->file = NULL;
+    vma->file_offset = file_offset;
+    vma->file_size = file_size;
+
+    if (type == VMA_FILE) {
+        vma->file = vfs_node_dup(file);
+        if (!vma->file) {
+            kmem_cache_free(vma_cache, vma);
+            return NULL;
+        }
+    }
+
+    vma->next = *link;
+    *link = vma;
+    return vma;
+}
+
+// Give dst a copy of src's areas. dst must have none yet.
+bool vma_clone(process_t* dst, process_t* src) {
+    for (vm_area_t* vma = src->vmas; vma; vma = vma->next) {
+        if (!vma_map(&dst->vmas, vma->start, vma->end, vma->flags, vma->type,
+                     vma->file, vma->file_offset, vma->file_size)) {
+            vma_free_all(&dst->vmas);
+            return false;
+        }
+    }
+    return true;
+}
+
+vm_area_t* vma_find(process_t* proc, uint32_t addr) {
+    if (!proc) return NULL;
+
+    for (vm_area_t* vma = proc->vmas; vma && vma->start <= addr; vma = vma->next) {
+        if (addr < vma->end) return vma;
+    }
+    return NULL;
+}
+
+// Whether [addr, addr + len) lies wholly in areas of proc that allow the
+// access. Syscalls check user buffers with this before touching them.
+bool vma_access_ok(process_t* proc, uint32_t addr, uint32_t len, bool write) {
+    uint32_t end = addr + len;
+    if (end < addr || end > KERNEL_SPACE_BASE) return false;
+
+    while (addr < end) {
+        vm_area_t* vma = vma_find(proc, addr);
+        if (!vma || (write && !(vma->flags & VM_WRITE))) return false;
+        addr = vma->end;
+    }
+    return true;
+}
+
+// Whether a NUL-terminated user string lies wholly in areas of proc
+bool vma_string_ok(process_t* proc, const char* str) {
+    uint32_t addr = (uint32_t)str;
+
+    while (1) {
+        vm_area_t* vma = vma_find(proc, addr);
+        if (!vma) return false;
+        for (; addr < vma->end; addr++) {
+            if (*(const char*)addr == '\0') return true;
+        }
+    }
+}
+
+// Drop an area list only; the pages mapped in it are left alone
+void vma_free_all(vm_area_t** list) {
+    while (*list) {
+        vm_area_t* vma = *list;
+        *list = vma->next;
+        vma_free(vma);
+    }
+}
+
+// Drop every area of the current process along with the pages mapped
+// in them
+void vma_unmap_all(process_t* proc) {
+    while (proc->vmas) {
+        vm_area_t* vma = proc->vmas;
+        proc->vmas = vma->next;
+
+        for (uint32_t addr = vma->start; addr < vma->end; addr += PAGE_SIZE) {
+            // A large page lies wholly inside the area
+            uint32_t pde = paging_get_pde(proc->page_directory, addr);
+            if ((pde & PAGE_PRESENT) && (pde & PAGE_4MB) && (pde & PAGE_USER)) {
+                paging_put_user_frame(proc->page_directory, pde & 0xFFC00000);
+                addr = (addr | (HUGE_PAGE_SIZE - 1)) + 1 - PAGE_SIZE;
+                continue;
+            }
+
+            uint32_t pte = paging_get_pte(proc->page_directory, addr);
+            if (pte & PAGE_PRESENT) {
+                paging_put_user_frame(proc->page_directory, pte & 0xFFFFF000);
+            } else if (pte & PAGE_SWAPPED) {
+                swap_free(pte);
+            }
+        }
+        paging_unmap_range(vma->start, (vma->end - vma->start) / PAGE_SIZE);
+        vma_free(vma);
+    }
+}
+
+static uint32_t vma_page_flags(vm_area_t* vma) {
+    uint32_t flags = PAGE_PRESENT | PAGE_USER;
+    if (vma->flags & VM_WRITE) flags |= PAGE_WRITE;
+    return flags;
+}
+
+// Extend a stack area down to cover addr, if addr is within the stack
+// limit and no other area is in the way
+static vm_area_t* stack_grow(process_t* proc, uint32_t addr) {
+    vm_area_t* prev = NULL;
+    vm_area_t* vma = proc->vmas;
+    while (vma && vma->end <= addr) {
+        prev = vma;
+        vma = vma->next;
+    }
+
+    if (!vma || !(vma->flags & VM_GROWSDOWN)) return NULL;
+    if (addr + USER_STACK_MAX < vma->end) return NULL;
+
+    uint32_t page = addr & 0xFFFFF000;
+    if (prev && prev->end > page) return NULL;
+
+    vma->start = page;
+    return vma;
+}
+
+// User frame for a fault. When memory runs out, file pages no process
+// maps are dropped from the page cache, then anonymous pages are paged
+// out to make room.
+static uint32_t fault_alloc_frame(bool zeroed) {
+    uint32_t frame = zeroed ? pmm_alloc_zeroed_user_page() : pmm_alloc_user_page();
+    if (!frame && (pagecache_reclaim(RECLAIM_PAGES) || swap_out(RECLAIM_PAGES))) {
+        frame = zeroed ? pmm_alloc_zeroed_user_page() : pmm_alloc_user_page();
+    }
+    return frame;
+}
+
+// Bring a paged-out page back in
+static bool swapped_fault(vm_area_t* vma, uint32_t page, uint32_t pte) {
+    uint32_t frame = fault_alloc_frame(false);
+    if (!frame) return false;
+
+    if (!swap_in(pte, frame)) {
+        pmm_free_page(frame);
+        return false;
+    }
+    // The page table holding the swap entry is still there
+    if (!paging_map_page(page, frame, vma_page_flags(vma))) {
+        pmm_free_page(frame);
+        return false;
+    }
+    return true;
+}
+
+// Back the whole aligned 4MB region around page with one large page, if
+// the area covers it and nothing in it is mapped yet. Falls back to 4KB
+// pages when no contiguous run is free.
+static bool huge_fault(process_t* proc, vm_area_t* vma, uint32_t page) {
+    uint32_t base = page & ~(HUGE_PAGE_SIZE - 1);
+    if (base < vma->start || vma->end - base < HUGE_PAGE_SIZE) return false;
+    if (paging_get_pde(proc->page_directory, base) & PAGE_PRESENT) return false;
+
+    uint32_t frame = pmm_alloc_huge_user_page();
+    if (!frame) return false;
+
+    for (uint32_t i = 0; i < HUGE_PAGE_PAGES; i++) {
+        uint32_t* buffer = (uint32_t*)kmap_temp(frame + i * PAGE_SIZE);
+        if (!buffer) {
+            page_put(frame);
+            return false;
+        }
+        for (uint32_t j = 0; j < PAGE_SIZE / 4; j++) {
+            buffer[j] = 0;
+        }
+        kunmap_temp(buffer);
+    }
+
+    if (!paging_map_huge(base, frame, vma_page_flags(vma))) {
+        page_put(frame);
+        return false;
+    }
+    return true;
+}
+
+// Reads map the zero page, so only a write commits a large page
+static bool anon_fault(process_t* proc, vm_area_t* vma, uint32_t page, bool write) {
+    if (write && huge_fault(proc, vma, page)) return true;
+
+    if (!write && zero_frame) {
+        page_get(zero_frame);
+        if (!paging_map_page(page, zero_frame, vma_page_flags(vma) & ~PAGE_WRITE)) {
+            page_put(zero_frame);
+            return false;
+        }
+        return true;
+    }
+
+    uint32_t frame = fault_alloc_frame(true);
+    if (!frame) return false;
+
+    if (!paging_map_page(page, frame, vma_page_flags(vma))) {
+        pmm_free_page(frame);
+        return false;
+    }
+    return true;
+}
+
+// Bytes of file data behind the page at addr
+static uint32_t file_page_bytes(vm_area_t* vma, uint32_t addr) {
+    uint32_t offset = addr - vma->start;
+    if (offset >= vma->file_size) return 0;
+    return (vma->file_size - offset < PAGE_SIZE) ? vma->file_size - offset : PAGE_SIZE;
+}
+
+// Frame holding one page of the window's file data (count bytes read
+// from the window start), zero-filled past the area's file data
+static uint32_t file_fill_page(vm_area_t* vma, uint32_t addr, uint32_t start,
+                               const uint8_t* data, uint32_t count) {
+    uint32_t frame = fault_alloc_frame(false);
+    if (!frame) return 0;
+
+    uint8_t* buffer = (uint8_t*)kmap_temp(frame);
+    if (!buffer) {
+        pmm_free_page(frame);
+        return 0;
+    }
+
+    uint32_t pos = addr - start;
+    uint32_t bytes = 0;
+    if (pos < count) {
+        bytes = count - pos;
+        if (bytes > file_page_bytes(vma, addr)) bytes = file_page_bytes(vma, addr);
+    }
+    for (uint32_t i = 0; i < bytes; i++) {
+        buffer[i] = data[pos + i];
+    }
+    for (uint32_t i = bytes; i < PAGE_SIZE; i++) {
+        buffer[i] = 0;
+    }
+    kunmap_temp(buffer);
+    return frame;
+}
+
+// File pages are shared through the page cache and mapped read-only in
+// every area; a write to a writable area copies the page first.
+// Pages already cached are mapped without I/O. Otherwise an aligned
+// window of pages around the fault is read with one file read, so
+// sequential access takes one fault per window instead of one per page.
+static bool file_fault(process_t* proc, vm_area_t* vma, uint32_t page) {
+    uint32_t window = FAULT_AROUND_PAGES * PAGE_SIZE;
+    uint32_t start = page & ~(window - 1);
+    uint32_t end = start + window;
+    if (start < vma->start) start = vma->start;
+    if (end > vma->end) end = vma->end;
+
+    uint32_t flags = vma_page_flags(vma) & ~PAGE_WRITE;
+    bool mapped = false;
+    for (uint32_t addr = start; addr < end; addr += PAGE_SIZE) {
+        if (paging_get_pte(proc->page_directory, addr) & PAGE_PRESENT) continue;
+
+        uint32_t frame = pagecache_find(vma->file, vma->file_offset + (addr - vma->start),
+                                        file_page_bytes(vma, addr));
+        if (!frame) continue;
+
+        if (!paging_map_page(addr, frame, flags)) {
+            page_put(frame);
+            continue;
+        }
+        if (addr == page) mapped = true;
+    }
+    if (mapped) return true;
+
+    arena_t* scratch = arena_current();
+    arena_mark_t mark = arena_begin(scratch);
+    uint8_t* data = NULL;
+    uint32_t count = 0;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        uint32_t offset = start - vma->start;
+        if (offset >= vma->file_size) break;
+
+        count = vma->file_size - offset;
+        if (count > end - start) count = end - start;
+        data = (uint8_t*)arena_alloc(scratch, count);
+        if (data) {
+            count = vfs_read(vma->file, vma->file_offset + offset, count, data);
+            break;
+        }
+
+        // Short of scratch memory: fall back to the faulting page alone
+        count = 0;
+        start = page;
+        end = page + PAGE_SIZE;
+    }
+    if (!data && start - vma->start < vma->file_size) {
+        return false;
+    }
+
+    bool ok = true;
+    for (uint32_t addr = start; addr < end; addr += PAGE_SIZE) {
+        if (paging_get_pte(proc->page_directory, addr) & PAGE_PRESENT) continue;
+
+        // A short read must not be cached as zeroes for every later mapper
+        uint32_t pos = addr - start;
+        uint32_t want = file_page_bytes(vma, addr);
+        if (want && (pos >= count || count - pos < want)) {
+            if (addr == page) ok = false;
+            continue;
+        }
+
+        uint32_t frame = file_fill_page(vma, addr, start, data, count);
+        if (!frame) {
+            if (addr == page) ok = false;
+            continue;
+        }
+
+        pagecache_add(vma->file, vma->file_offset + (addr - vma->start),
+                      file_page_bytes(vma, addr), frame);
+        if (!paging_map_page(addr, frame, flags)) {
+            page_put(frame);
+            if (addr == page) ok = false;
+        }
+    }
+
+    arena_reset(scratch, mark);
+    return ok;
+}
+
+// Write to a read-only page of a writable area: the frame is shared.
+// The last user takes it over; anyone else gets a private copy.
+static bool cow_fault(vm_area_t* vma, uint32_t page, uint32_t pte) {
+    uint32_t frame = pte & 0xFFFFF000;
+    struct page* info = pmm_get_page(frame);
+
+    // Nothing to copy out of the zero page
+    if (frame == zero_frame) {
+        uint32_t fresh = fault_alloc_frame(true);
+        if (!fresh) return false;
+
+        if (!paging_map_page(page, fresh, vma_page_flags(vma))) {
+            pmm_free_page(fresh);
+            return false;
+        }
+        page_put(frame);
+        return true;
+    }
+
+    if (info && info->refcount == 1) {
+        return paging_map_page(page, frame, vma_page_flags(vma));
+    }
+
+    uint32_t copy = fault_alloc_frame(false);
+    if (!copy) return false;
+
+    uint32_t* src = (uint32_t*)kmap_temp(frame);
+    uint32_t* dst = (uint32_t*)kmap_temp(copy);
+    if (!src || !dst) {
+        if (src) kunmap_temp(src);
+        if (dst) kunmap_temp(dst);
+        pmm_free_page(copy);
+        return false;
+    }
+    for (uint32_t i = 0; i < PAGE_SIZE / 4; i++) {
+        dst[i] = src[i];
+    }
+    kunmap_temp(dst);
+    kunmap_temp(src);
+
+    if (!paging_map_page(page, copy, vma_page_flags(vma))) {
+        pmm_free_page(copy);
+        return false;
+    }
+    paging_put_user_frame(process_get_current()->page_directory, frame);
+    return true;
+}
+
+// Resolve a fault on a user address in the current process. Returns
+// false if the access is not allowed or cannot be satisfied.
+bool vma_handle_fault(uint32_t fault_addr, uint32_t err) {
+    process_t* proc = process_get_current();
+    if (!proc) return false;
+
+    vm_area_t* vma = vma_find(proc, fault_addr);
+    if (!vma) {
+        vma = stack_grow(proc, fault_addr);
+        if (!vma) return false;
+    }
+
+    bool write = (err & FAULT_WRITE) != 0;
+    if (write && !(vma->flags & VM_WRITE)) return false;
+
+    uint32_t page = fault_addr & 0xFFFFF000;
+    if (err & FAULT_PRESENT) {
+        // Only a write to a shared page is a legal protection fault
+        if (!write) return false;
+        return cow_fault(vma, page, paging_get_pte(proc->page_directory, page));
+    }
+
+    uint32_t pte = paging_get_pte(proc->page_directory, page);
+    if (pte & PAGE_SWAPPED) {
+        return swapped_fault(vma, page, pte);
+    }
+
+    if (vma->type == VMA_FILE) {
+        if (!file_fault(proc, vma, page)) return false;
+        if (!write) return true;
+        return cow_fault(vma, page, paging_get_pte(proc->page_directory, page));
+    }
+    return anon_fault(proc, vma, page, write);
+}
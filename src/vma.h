@@ -0,0 +1,60 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include "types.h"
+#include "vfs.h"
+#include "pmm.h"
+
+// Area permissions
+#define VM_READ      0x01
+#define VM_WRITE     0x02
+#define VM_EXEC      0x04
+#define VM_GROWSDOWN 0x08  // Stack: faults just below the area extend it
+
+// Page fault error code bits
+#define FAULT_PRESENT  0x01  // Protection violation on a present page
+#define FAULT_WRITE    0x02
+#define FAULT_USER     0x04
+#define FAULT_RESERVED 0x08
+
+// User areas live between the kernel's identity map and kernel space
+#define USER_SPACE_BASE PMM_DIRECT_MAP_LIMIT
+
+// The user stack grows down from the kernel boundary, up to USER_STACK_MAX
+#define USER_STACK_TOP 0xC0000000
+#define USER_STACK_MAX (1024 * 1024)
+
+typedef enum {
+    VMA_ANON = 0,   // Zero-filled on first touch
+    VMA_FILE        // Filled from a file on first touch
+} vma_type_t;
+
+// A range of user address space with one set of permissions and one
+// backing object
+typedef struct vm_area {
+    uint32_t start;         // Page aligned
+    uint32_t end;           // Page aligned, exclusive
+    uint32_t flags;         // VM_*
+    vma_type_t type;
+
+    fs_node_t* file;        // VMA_FILE: private copy of the file node,
+    uint32_t file_offset;   // file offset of start, and bytes of file
+    uint32_t file_size;     // data from start; the rest reads as zero
+
+    struct vm_area* next;   // Sorted by address
+} vm_area_t;
+
+struct process;
+
+void vma_init(void);
+vm_area_t* vma_map(vm_area_t** list, uint32_t start, uint32_t end, uint32_t flags,
+                   vma_type_t type, fs_node_t* file, uint32_t file_offset, uint32_t file_size);
+vm_area_t* vma_find(struct process* proc, uint32_t addr);
+bool vma_access_ok(struct process* proc, uint32_t addr, uint32_t len, bool write);
+bool vma_string_ok(struct process* proc, const char* str);
+bool vma_clone(struct process* dst, struct process* src);
+void vma_free_all(vm_area_t** list);
+void vma_unmap_all(struct process* proc);
+bool vma_handle_fault(uint32_t fault_addr, uint32_t err);
+
+#endif
@@ -0,0 +1,121 @@
+#include "vmalloc.h"
+#include "heap.h"
+#include "pmm.h"
+#include "paging.h"
+
+// vmalloc maps scattered PMM frames behind one contiguous kernel virtual
+// buffer, so large allocations never need physically contiguous memory
+// and may use frames above the identity-mapped first 1GB.
+// Every area is followed by an unmapped guard page to catch overruns.
+
+struct vmap_area {
+    uint32_t start;
+    uint32_t pages;             // Mapped pages, not counting the guard page
+    struct vmap_area* next;     // Sorted by start address
+};
+
+static struct vmap_area* vmap_areas = NULL;
+
+// First gap in the vmalloc range that holds span bytes
+static uint32_t vmap_find_gap(uint32_t span, struct vmap_area** prev_out) {
+    uint32_t addr = VMALLOC_START;
+    struct vmap_area* prev = NULL;
+
+    for (struct vmap_area* area = vmap_areas; area; area = area->next) {
+        if (area->start - addr >= span) break;
+        addr = area->start + (area->pages + 1) * PAGE_SIZE;
+        prev = area;
+    }
+
+    if (addr > VMALLOC_END || VMALLOC_END - addr < span) return 0;
+    *prev_out = prev;
+    return addr;
+}
+
+static void vmap_release_pages(uint32_t start, uint32_t pages) {
+    for (uint32_t i = 0; i < pages; i++) {
+        uint32_t phys = paging_get_physical(start + i * PAGE_SIZE);
+        if (phys) pmm_free_page(phys);
+    }
+    paging_unmap_range(start, pages);
+}
+
+void* vmalloc(size_t size) {
+    if (size == 0 || size > VMALLOC_END - VMALLOC_START) return NULL;
+
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    struct vmap_area* area = (struct vmap_area*)kmalloc(sizeof(struct vmap_area));
+    if (!area) return NULL;
+
+    struct vmap_area* prev;
+    uint32_t start = vmap_find_gap((pages + 1) * PAGE_SIZE, &prev);
+    if (!start) {
+        kfree(area);
+        return NULL;
+    }
+
+    // Gather the frames first so the range is mapped in one pass
+    uint32_t* frames = (uint32_t*)kmalloc(pages * sizeof(uint32_t));
+    if (!frames) {
+        kfree(area);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < pages; i++) {
+        frames[i] = pmm_alloc_high_page();
+        if (!frames[i]) {
+            while (i > 0) pmm_free_page(frames[--i]);
+            kfree(frames);
+            kfree(area);
+            return NULL;
+        }
+    }
+    if (!paging_map_frames(start, frames, pages, PAGE_PRESENT | PAGE_WRITE)) {
+        // Mapping stopped partway; the frame list covers the unmapped tail too
+        paging_unmap_range(start, pages);
+        for (uint32_t i = 0; i < pages; i++) {
+            pmm_free_page(frames[i]);
+        }
+        kfree(frames);
+        kfree(area);
+        return NULL;
+    }
+    kfree(frames);
+
+    area->start = start;
+    area->pages = pages;
+    if (prev) {
+        area->next = prev->next;
+        prev->next = area;
+    } else {
+        area->next = vmap_areas;
+        vmap_areas = area;
+    }
+
+    return (void*)start;
+}
+
+void vfree(void* addr) {
+    if (!addr) return;
+
+    struct vmap_area* prev = NULL;
+    struct vmap_area* area = vmap_areas;
+    while (area && area->start != (uint32_t)addr) {
+        prev = area;
+        area = area->next;
+    }
+    if (!area) return;  // Not the start of a vmalloc area
+
+    if (prev) {
+        prev->next = area->next;
+    } else {
+        vmap_areas = area->next;
+    }
+
+    vmap_release_pages(area->start, area->pages);
+    kfree(area);
+}
+
+bool is_vmalloc_addr(const void* addr) {
+    return (uint32_t)addr >= VMALLOC_START && (uint32_t)addr < VMALLOC_END;
+}
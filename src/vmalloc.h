@@ -0,0 +1,14 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include "types.h"
+
+// Kernel virtual range for large, virtually contiguous allocations
+#define VMALLOC_START 0xD0000000
+#define VMALLOC_END   0xF0000000
+
+void* vmalloc(size_t size);
+void vfree(void* addr);
+bool is_vmalloc_addr(const void* addr);
+
+#endif
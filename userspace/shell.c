@@ -1,9 +1,12 @@
 // FlowOS Shell - Simple command line interface
 
 #define SYS_EXIT  1
+#define SYS_FORK  2
 #define SYS_READ  3
 #define SYS_WRITE 4
+#define SYS_WAIT  7
 #define SYS_EXEC  11
+#define SYS_MEMINFO 20
 
 // Syscall wrappers
 static inline int syscall1(int num, int arg1) {
@@ -26,10 +29,22 @@ static int read(char* buffer, int max_len) {
     return syscall2(SYS_READ, (int)buffer, max_len);
 }
 
+static int fork(void) {
+    return syscall1(SYS_FORK, 0);
+}
+
+static int wait(int pid) {
+    return syscall1(SYS_WAIT, pid);
+}
+
 static int exec(const char* path) {
     return syscall1(SYS_EXEC, (int)path);
 }
 
+static void meminfo(void) {
+    syscall1(SYS_MEMINFO, 0);
+}
+
 static void exit(int code) {
     syscall1(SYS_EXIT, code);
 }
@@ -73,6 +88,7 @@ void _start(void) {
             write("  help  - Show this help\n");
             write("  clear - Clear screen\n");
             write("  test  - Run test program\n");
+            write("  meminfo - Dump kernel heap statistics to serial\n");
             write("  exit  - Exit shell\n\n");
         }
         else if (strcmp(buffer, "clear") == 0 || strcmp(buffer, "cls") == 0) {
@@ -81,6 +97,10 @@ void _start(void) {
                 write("\n");
             }
         }
+        else if (strcmp(buffer, "meminfo") == 0) {
+            meminfo();
+            write("Heap statistics written to serial\n");
+        }
         else if (strcmp(buffer, "exit") == 0) {
             write("Goodbye!\n");
             exit(0);
@@ -99,11 +119,19 @@ void _start(void) {
             }
             path[len] = '\0';
             
-            int result = exec(path);
-            if (result < 0) {
+            // Run the program in a child so the shell survives it
+            int pid = fork();
+            if (pid == 0) {
+                exec(path);
                 write("Command not found: ");
                 write(buffer);
                 write("\n");
+                exit(127);
+            }
+            if (pid < 0) {
+                write("fork failed\n");
+            } else {
+                wait(pid);
             }
         }
     }
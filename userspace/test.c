@@ -18,5 +18,5 @@ void _start(void) {
     syscall1(SYS_WRITE, (int)msg);
     
     // Exit
-    while(1);  // Infinite loop for now
+    syscall1(SYS_EXIT, 0);
 }